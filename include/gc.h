@@ -1,31 +1,257 @@
 #ifndef GC_H
 #define GC_H
 
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
 typedef void (*FinalizerT)(void *ptr, size_t size);
 
+enum GcSweepMode {
+    GC_SWEEP_EAGER,   // вся куча подметается сразу после маркировки
+    GC_SWEEP_LAZY,    // спаны подметаются при нехватке слотов в аллокаторе и фоновым сборщиком
+    GC_SWEEP_CONCURRENT  // отдельный поток подметает кучу параллельно с мутаторами
+};
+
 void* gc_malloc(size_t size);
 void* gc_malloc_manage(size_t size, FinalizerT finalizer);
 void* gc_malloc_root(size_t size);
 void* gc_malloc_root_manage(size_t size, FinalizerT finalizer);
 void* gc_malloc_with_parent(size_t size, void *parent);
 void* gc_malloc_with_parent_manage(size_t size, void *parent, FinalizerT finalizer);
+// Объект можно указывать любым адресом внутри него, не только тем, что вернул gc_malloc:
+// ребро или корень относится к объекту целиком
 void gc_add_edge(void *parent, void *child);
 void gc_del_edge(void *parent, void *child);
 void gc_swap_edge(void *parent, void *child1, void *child2);
 void gc_add_root(void *ptr);
 void gc_delete_root(void *ptr);
+
+// Пакетные варианты: блокировки берутся и барьеры выполняются один раз на пачку, а не на ребро
+struct GcEdge {
+    void *parent;
+    void *child;
+};
+void gc_add_edges(void *parent, void *const *children, size_t count);
+void gc_add_edges_pairs(const GcEdge *edges, size_t count);
+void gc_add_roots(void *const *ptrs, size_t count);
+void gc_delete_roots(void *const *ptrs, size_t count);
+
+// Стек хэндлов текущего потока — корни с временем жизни области видимости, для gc::Root.
+// Хэндлы снимаются строго в обратном порядке; общих блокировок ни то, ни другое не берёт
+void gc_push_handle(void *ptr);
+void gc_pop_handle();
+
+// Консервативные корни: стек и регистры зарегистрированного потока просматриваются в начале
+// каждой сборки, и любое слово, указывающее внутрь живого объекта, держит его. Поток на это
+// время останавливается сигналом SIGPWR. Возвращает false, если границы стека узнать не удалось
+bool gc_register_thread();
+void gc_unregister_thread();
 void gc_block_collect();
 void gc_unlock_collect();
 void gc_collect();
+// Полная сборка на потоке сборщика: вызов сразу возвращается, мутаторы работают, пока идёт маркировка
+void gc_collect_concurrent();
+// Ждёт окончания сборок, запрошенных gc_collect_concurrent
+void gc_wait_for_collection();
+// Полная сборка с уплотнением: объекты из полупустых спанов переезжают, освободившиеся
+// страницы возвращаются системе. Ссылки в рёбрах и полях типизированных объектов обновляются,
+// корни, закреплённые и нетипизированные объекты (из gc_malloc и его вариантов) не двигаются.
+// Любой другой адрес объекта, сохранённый мутатором, после уплотнения недействителен.
+// Возвращает число возвращённых системе байт
+size_t gc_compact();
+// Запрещает уплотнению двигать объект. Повторное закрепление ничего не добавляет
+void gc_pin(void *ptr);
+void gc_unpin(void *ptr);
+// Малая сборка: обходит только молодые объекты, начиная с молодых корней и запомненного множества
+void gc_collect_minor();
+// Сколько байт выделяется между малыми сборками фонового сборщика, 0 — он их не делает
+void gc_set_nursery_size(size_t bytes);
+// Число потоков маркировки при полной сборке, 0 — по числу ядер
+void gc_set_mark_threads(size_t threads);
+void gc_set_sweep_mode(GcSweepMode mode);
+
+// Паузы последнего цикла (полного или малого). Мутаторы стоят, пока снимаются корни
+// и пока завершается маркировка; сама маркировка идёт параллельно с ними
+struct GcPauseInfo {
+    uint64_t initial_pause_ns;
+    uint64_t final_pause_ns;
+    uint64_t concurrent_mark_ns;
+};
+void gc_get_last_pauses(GcPauseInfo *info);
+
+// Телеметрия. Счётчики копятся всегда: мутаторы трогают только relaxed-атомики в редких
+// ветках барьеров, воркеры маркировки считают у себя и сливают итог в конце фазы
+constexpr size_t GC_PAUSE_BUCKETS = 64;
+
+// Один цикл сборки. Подметание и финализация ленивые, поэтому в цикл попадает то, что
+// сделано с конца прошлого цикла до конца этого
+struct GcCycleStats {
+    uint64_t cycle;               // номер цикла, полные и малые нумеруются вместе
+    bool minor;
+    uint64_t initial_pause_ns;
+    uint64_t final_pause_ns;
+    uint64_t mark_ns;             // от начала первой паузы до конца последней
+    uint64_t sweep_ns;
+    uint64_t finalize_ns;
+    uint64_t objects_marked;
+    uint64_t bytes_marked;
+    uint64_t edges_traced;        // просмотренные рёбра и поля-указатели
+    uint64_t objects_freed;
+    uint64_t bytes_freed;
+    uint64_t objects_finalized;
+    // Объекты, отмеченные барьером записи, и старые объекты, попавшие в запомненное множество
+    uint64_t barrier_hits;
+    double allocation_rate;       // байт в секунду между концом прошлого цикла и началом этого
+};
+
+// Итоги за всё время работы. Паузы — все остановки мутаторов, в том числе уплотнением;
+// квантили оцениваются по гистограмме: корзина i — паузы от 2^i до 2^(i+1) нс
+struct GcStats {
+    uint64_t full_cycles;
+    uint64_t minor_cycles;
+    uint64_t mark_ns;
+    uint64_t sweep_ns;
+    uint64_t finalize_ns;
+    uint64_t objects_marked;
+    uint64_t bytes_marked;
+    uint64_t edges_traced;
+    uint64_t objects_freed;
+    uint64_t bytes_freed;
+    uint64_t objects_finalized;
+    uint64_t barrier_hits;
+    uint64_t allocated_bytes;
+    uint64_t live_bytes;          // отмеченный объём последней полной сборки
+    double allocation_rate;       // последнего цикла
+    uint64_t pause_count;
+    uint64_t pause_p50_ns;
+    uint64_t pause_p99_ns;
+    uint64_t pause_max_ns;
+    uint64_t pause_histogram[GC_PAUSE_BUCKETS];
+};
+void gc_get_stats(GcStats *stats);
+
+// Вызывается после каждого цикла потоком, который его завершил, уже вне блокировок сборщика.
+// nullptr отключает вызовы
+typedef void (*GcCycleCallback)(const GcCycleStats *cycle, void *arg);
+void gc_set_cycle_callback(GcCycleCallback callback, void *arg);
+
+// Запись трассы для утилиты gc_replay: выделения, регистрация типов, рёбра, корни, gc_store,
+// gc_collect, gc_collect_minor и хэндлы gc::Root. Куча на момент начала записи попадает в трассу
+// снимком в паузе: объекты с типами, рёбра, поля-указатели, корни и хэндлы. Ссылки только со стеков
+// не записываются: объект, который держал лишь стек, при воспроизведении может быть освобождён.
+// Финализаторы не записываются, при воспроизведении они пустые; gc_compact не записывается.
+// Возвращает false, если файл не открылся или запись уже идёт
+bool gc_trace_start(const char *path);
+// Закрывает файл и возвращает число записанных событий
+size_t gc_trace_stop();
+
+// Снимок кучи для утилиты gc_dominators: объекты с размерами, типами и индексами финализаторов,
+// рёбра и поля-указатели, явные корни и найденные на стеках. Мутаторы стоят только на время
+// обхода кучи, файл пишется после паузы. Возвращает false, если файл не записался
+bool gc_dump_heap(const char *path);
+
+// Финализаторы мёртвых объектов ставятся в очередь и выполняются вне блокировок сборщика.
+// Без потока финализации очередь разбирает gc_collect или явный вызов gc_run_finalizers
+size_t gc_run_finalizers(size_t max);
+void gc_start_finalizer_thread();
+void gc_stop_finalizer_thread();
 
 void gc_start_incremental_mark();
 void gc_step_mark();
+// Маркирует не дольше budget_ns наносекунд, остаток бюджета отдаёт ленивому подметанию.
+// Возвращает true, если цикл завершён (или не был начат)
+bool gc_step_mark_for(uint64_t budget_ns);
+// То же, но бюджет — число просмотренных рёбер (каждый объект считается ещё за одно).
+// Подметание после завершённого цикла остаётся ленивым
+bool gc_step_mark_work(size_t edges);
 bool gc_is_marking();
 void gc_finish_incremental_mark();
 
-// Фоновый сборщик
+// Фоновый сборщик. Новый цикл он начинает, когда с конца прошлой маркировки выделено
+// percent% от объёма живых данных (как GOGC); мутаторы, обгоняющие маркировку, помогают ей в gc_malloc.
+// Отрицательный percent отключает пейсер: фоновый сборщик тогда начинает полный цикл раз в interval_ms
+void gc_set_gc_percent(int percent);
+// Пустые страницы кучи, пролежавшие без дела delay_ms миллисекунд, фоновый сборщик возвращает
+// системе (madvise MADV_DONTNEED). Отрицательное значение отключает возврат, по умолчанию 1000
+void gc_set_scavenge_delay(int delay_ms);
+// Дометает кучу и сразу возвращает системе все пустые страницы. Возвращает число байт
+size_t gc_release_memory();
 void gc_start_background_collector(size_t steps, int interval_ms);
 void gc_stop_background_collector();
 bool gc_is_background_collector_running();
 
+// Типизированные объекты: маркировка читает указатели прямо из полей по зарегистрированным
+// смещениям, рёбра для них поддерживать не нужно. Память объекта обнуляется при выделении.
+// Указатель в поле записывается только через gc_store — она выполняет барьеры записи.
+// Возвращает 0, если смещение выходит за объект или не выровнено под указатель
+uint32_t gc_register_type(size_t size, const size_t *offsets, size_t count);
+void* gc_malloc_typed(uint32_t type);
+void gc_store(void *parent, void **field, void *value);
+
+namespace gc {
+
+template <class T, class F>
+constexpr bool IsPointerField(F T::*) {
+    return std::is_pointer_v<F>;
+}
+
+template <class T, class F>
+size_t FieldOffset(F T::*field) {
+    alignas(T) static unsigned char probe[sizeof(T)];
+    const T *object = reinterpret_cast<const T*>(probe);
+    return reinterpret_cast<const unsigned char*>(&(object->*field)) - probe;
+}
+
+// Тип регистрируется при первом обращении: TypeId<Node, &Node::left, &Node::right>()
+template <class T, auto... Fields>
+uint32_t TypeId() {
+    static_assert(std::is_standard_layout_v<T>, "смещения полей определены только для standard layout");
+    static_assert((IsPointerField(Fields) && ...), "описываются только поля-указатели");
+    static const uint32_t id = [] {
+        size_t offsets[] = {FieldOffset(Fields)..., 0};
+        return gc_register_type(sizeof(T), offsets, sizeof...(Fields));
+    }();
+    return id;
+}
+
+// Конструктор не вызывается: подходит для простых структур, все поля которых начинаются с нуля
+template <class T, auto... Fields>
+T* New() {
+    return static_cast<T*>(gc_malloc_typed(TypeId<T, Fields...>()));
+}
+
+template <class T, class F>
+void Store(T *parent, F *T::*field, std::type_identity_t<F> *value) {
+    gc_store(parent, reinterpret_cast<void**>(&(parent->*field)), value);
+}
+
+// Держит объект живым, пока жив сам хэндл. Хэндлы одного потока вкладываются как области видимости,
+// поэтому не копируются и не перемещаются
+template <class T>
+class Root {
+    T *ptr_;
+public:
+    explicit Root(T *ptr) : ptr_(ptr) {
+        gc_push_handle(ptr);
+    }
+    ~Root() {
+        gc_pop_handle();
+    }
+    Root(const Root&) = delete;
+    Root& operator=(const Root&) = delete;
+
+    T* get() const {
+        return ptr_;
+    }
+    T* operator->() const {
+        return ptr_;
+    }
+    std::add_lvalue_reference_t<T> operator*() const {
+        return *ptr_;
+    }
+};
+
+}
+
 #endif //GC_H
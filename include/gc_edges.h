@@ -0,0 +1,116 @@
+#ifndef GC_EDGES_H
+#define GC_EDGES_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "gc_spinlock.h"
+
+// Список рёбер объекта. Первые kInlineEdges детей лежат прямо в записи, без отдельной аллокации;
+// при большем числе детей список переезжает в отсортированный по адресу массив в куче.
+// Повторно добавленное ребро увеличивает счётчик, поэтому gc_del_edge снимает ровно одно добавление
+class EdgeList {
+public:
+    static constexpr uint32_t kInlineEdges = 4;
+    // Пачки меньше этого выгоднее добавлять по одному ребру
+    static constexpr size_t kBulkThreshold = 16;
+private:
+    uint32_t size_{0};
+    uint32_t capacity_{kInlineEdges};
+    union {
+        struct {
+            void *children_[kInlineEdges];
+            uint32_t counts_[kInlineEdges];
+        } inline_;
+        struct {
+            void **children_;
+            uint32_t *counts_;
+        } heap_;
+    };
+
+    bool IsInline() const {
+        return capacity_ == kInlineEdges;
+    }
+    void** Children() {
+        return IsInline() ? inline_.children_ : heap_.children_;
+    }
+    uint32_t* Counts() {
+        return IsInline() ? inline_.counts_ : heap_.counts_;
+    }
+    uint32_t Find(const void *child);
+    void Grow();
+    void SortByAddress();
+public:
+    EdgeList() {}
+    ~EdgeList();
+    EdgeList(const EdgeList&) = delete;
+    EdgeList& operator=(const EdgeList&) = delete;
+
+    void Add(void *child);
+    // Пачка рёбер сортируется и сливается со списком за один проход
+    void AddMany(void *const *children, size_t count);
+    // Возвращает false, если такого ребра не было
+    bool Remove(void *child);
+    void Clear();
+    // Заменяет каждого ребёнка на map(child). Разные дети должны остаться разными
+    template <class Map>
+    void Rewrite(Map &&map) {
+        void **children = Children();
+        bool changed = false;
+        for (uint32_t i = 0; i < size_; ++i) {
+            void *mapped = map(children[i]);
+            changed |= mapped != children[i];
+            children[i] = mapped;
+        }
+        if (changed && !IsInline()) {
+            SortByAddress();
+        }
+    }
+
+    uint32_t size() const {
+        return size_;
+    }
+    void* const* begin() const {
+        return IsInline() ? inline_.children_ : heap_.children_;
+    }
+    void* const* end() const {
+        return begin() + size_;
+    }
+};
+
+// Таблица списков рёбер. Объект хранит в метаданных только 32-битный дескриптор,
+// сами списки лежат в чанках и не переезжают при росте таблицы
+class EdgeTable {
+    static constexpr size_t kChunkBits = 12;
+    static constexpr size_t kChunkSize = size_t{1} << kChunkBits;
+    static constexpr size_t kMaxChunks = size_t{1} << 16;
+    static constexpr unsigned kLockStripeBits = 10;
+    static constexpr size_t kLockStripes = size_t{1} << kLockStripeBits;
+
+    struct alignas(64) Stripe {
+        SpinLock lock_;
+    };
+
+    std::atomic<EdgeList*> chunks_[kMaxChunks]{};
+    uint32_t next_handle_{1};
+    std::vector<uint32_t> free_handles_;
+    std::mutex mutex_;
+    Stripe stripes_[kLockStripes];
+public:
+    ~EdgeTable();
+
+    uint32_t Create();
+    void Release(uint32_t handle);
+    EdgeList& Get(uint32_t handle) {
+        return chunks_[handle >> kChunkBits].load(std::memory_order_acquire)[handle & (kChunkSize - 1)];
+    }
+
+    // Защищает список рёбер объекта от одновременного изменения и обхода
+    SpinLock& LockFor(const void *object) {
+        return stripes_[AddressStripe(object, kLockStripeBits)].lock_;
+    }
+};
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef GC_HEAP_H
+#define GC_HEAP_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "gc_spinlock.h"
+
+// Страница кучи — единица, на которую нарезаются арены и по которой ведётся индекс страниц
+constexpr size_t kPageShift = 16;
+constexpr size_t kPageSize = size_t{1} << kPageShift;
+constexpr size_t kArenaPages = 64;
+
+constexpr size_t kMaxSmallSize = 8192;
+constexpr size_t kNumSizeClasses = 33;
+constexpr uint32_t kLargeSizeClass = 0;
+// Сколько байт слотов одного класса поток забирает из спана за раз
+constexpr size_t kThreadCacheBytes = 16384;
+
+size_t SizeClassOf(size_t size);
+size_t SizeClassSize(size_t size_class);
+
+// Метаданные объекта хранятся не рядом с ним, а в боковой таблице спана по номеру слота.
+// Занятость слота и метка живут отдельно, в битовых картах спана
+struct ObjectMeta {
+    uint32_t size_;
+    uint32_t edges_;        // дескриптор списка рёбер, 0 — рёбер нет; при работающих мутаторах — через atomic_ref
+    uint16_t finalizer_;    // индекс в таблице финализаторов, 0 — финализатор по умолчанию
+    uint16_t type_;         // индекс в таблице типов, 0 — объект без описания полей
+    uint8_t age_;           // сколько малых сборок пережил молодой объект
+};
+
+struct FreeSlot {
+    FreeSlot *next_;
+};
+
+struct Span;
+
+struct SpanList {
+    Span *head_{nullptr};
+    Span *tail_{nullptr};
+    size_t size_{0};
+    void Push(Span *span);
+    void Remove(Span *span);
+    // Переносит все спаны other в конец списка за O(1); их list_ остаётся прежним
+    void Splice(SpanList &other);
+};
+
+// Спан — непрерывный набор страниц: либо нарезанный на слоты одного размерного класса,
+// либо целиком отданный под один большой объект
+struct Span {
+    char *start_{nullptr};
+    size_t pages_{0};
+    size_t large_size_{0};
+    uint32_t size_class_{kLargeSizeClass};
+    uint32_t slot_size_{0};
+    uint32_t slot_count_{0};
+    uint32_t div_magic_{0};     // ceil(2^32 / slot_size_), у большого объекта 0 — любой адрес даёт слот 0
+    uint32_t live_count_{0};
+    uint32_t fresh_index_{0};   // слоты с этим индексом и дальше ещё ни разу не выдавались
+    FreeSlot *free_list_{nullptr};
+    ObjectMeta *meta_{nullptr};
+    std::atomic<uint64_t> *alloc_bits_{nullptr};
+    // Sweep обнуляет метки спана по ходу обхода, поэтому к началу следующего цикла все они чистые
+    std::atomic<uint64_t> *mark_bits_{nullptr};
+    // Мёртвые объекты, ждущие финализатора в очереди. Слот занят, но подметание его пропускает
+    std::atomic<uint64_t> *finalizing_bits_{nullptr};
+    // Молодое поколение: объекты, ещё не пережившие kPromotionAge малых сборок.
+    // Полная сборка повышает всех выживших, биты снимает подметание спана
+    std::atomic<uint64_t> *young_bits_{nullptr};
+    // Старые объекты, уже лежащие в запомненном множестве
+    std::atomic<uint64_t> *remembered_bits_{nullptr};
+    uint32_t meta_capacity_{0};
+    // Новые адреса объектов, вынесенных уплотнением; есть только у эвакуированных спанов
+    void **forward_{nullptr};
+    // Когда спан опустел; имеет смысл, пока он лежит в free_pages_
+    std::chrono::steady_clock::time_point idle_since_{};
+    Span *next_{nullptr};
+    Span *prev_{nullptr};
+    // У неподметённых спанов не обновляется: StartSweep переносит списки целиком
+    SpanList *list_{nullptr};
+    // Номер подметания, после которого спан подметён или создан
+    std::atomic<uint32_t> swept_epoch_{0};
+
+    uint32_t SlotIndex(const void *ptr) const {
+        uint64_t offset = static_cast<const char*>(ptr) - start_;
+        return static_cast<uint32_t>((offset * div_magic_) >> 32);
+    }
+    void* SlotAddress(uint32_t index) const {
+        return start_ + size_t{index} * slot_size_;
+    }
+    size_t ObjectSize(uint32_t index) const {
+        return size_class_ == kLargeSizeClass ? large_size_ : meta_[index].size_;
+    }
+    uint32_t BitmapWords() const {
+        return (slot_count_ + 63) / 64;
+    }
+    bool IsAllocated(uint32_t index) const {
+        return alloc_bits_[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64));
+    }
+    bool IsMarked(uint32_t index) const {
+        return mark_bits_[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64));
+    }
+    bool IsFinalizing(uint32_t index) const {
+        return finalizing_bits_[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64));
+    }
+    bool IsYoung(uint32_t index) const {
+        return young_bits_[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64));
+    }
+    bool IsRemembered(uint32_t index) const {
+        return remembered_bits_[index / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (index % 64));
+    }
+    // true, если бит выставил именно этот поток
+    bool TryRemember(uint32_t index) {
+        uint64_t bit = uint64_t{1} << (index % 64);
+        return !(remembered_bits_[index / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+    void Forget(uint32_t index) {
+        remembered_bits_[index / 64].fetch_and(~(uint64_t{1} << (index % 64)), std::memory_order_relaxed);
+    }
+    // true, если метку поставил именно этот поток
+    bool TryMark(uint32_t index) {
+        uint64_t bit = uint64_t{1} << (index % 64);
+        auto &word = mark_bits_[index / 64];
+        return !(word.load(std::memory_order_relaxed) & bit) &&
+               !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+};
+
+// Объект кучи, найденный по адресу
+struct ObjectRef {
+    Span *span_{nullptr};
+    uint32_t index_{0};
+
+    explicit operator bool() const {
+        return span_ != nullptr;
+    }
+    ObjectMeta& Meta() const {
+        return span_->meta_[index_];
+    }
+    bool IsMarked() const {
+        return span_->IsMarked(index_);
+    }
+    bool TryMark() const {
+        return span_->TryMark(index_);
+    }
+    bool IsYoung() const {
+        return span_->IsYoung(index_);
+    }
+};
+
+// Двухуровневый индекс: адрес страницы -> спан. Верхний уровень покрывает 48-битное адресное пространство
+class PageMap {
+    static constexpr size_t kLeafBits = 16;
+    static constexpr size_t kRootBits = 48 - kPageShift - kLeafBits;
+
+    struct Leaf {
+        std::atomic<Span*> spans_[size_t{1} << kLeafBits];
+    };
+
+    std::atomic<Leaf*> root_[size_t{1} << kRootBits]{};
+public:
+    void Set(const void *start, size_t pages, Span *span);
+    Span* Get(const void *addr) const {
+        uintptr_t page = reinterpret_cast<uintptr_t>(addr) >> kPageShift;
+        if (page >> (kRootBits + kLeafBits)) return nullptr;
+        Leaf *leaf = root_[page >> kLeafBits].load(std::memory_order_acquire);
+        if (!leaf) return nullptr;
+        return leaf->spans_[page & ((size_t{1} << kLeafBits) - 1)].load(std::memory_order_acquire);
+    }
+};
+
+// Кэш аллокации потока: по каждому классу — слоты, зарезервированные в одном спане.
+// Зарезервированный слот входит в live_count_ спана, но его бит занятости не выставлен,
+// поэтому подметание его не трогает, а спан не освобождается. Свой спинлок поток берёт
+// без конкуренции; куча захватывает его, только когда забирает слоты обратно
+struct ThreadCache {
+    struct Bin {
+        Span *span_{nullptr};
+        FreeSlot *head_{nullptr};
+    };
+
+    SpinLock lock_;
+    Bin bins_[kNumSizeClasses];
+    ThreadCache *next_{nullptr};
+    ThreadCache *prev_{nullptr};
+};
+
+class Heap {
+public:
+    // Возвращает false, если слот нужно оставить занятым до вызова FreeFinalized
+    using DeadObjectHook = std::function<bool(Span *span, uint32_t index)>;
+
+    // Итоги подметания за всё время
+    struct SweepCounters {
+        uint64_t objects_freed_{0};
+        uint64_t bytes_freed_{0};
+        uint64_t sweep_ns_{0};
+    };
+private:
+    std::mutex mutex_;
+    SpanList partial_[kNumSizeClasses];   // спаны, в которых есть свободные слоты
+    SpanList full_[kNumSizeClasses];
+    SpanList large_;
+    // Спаны, помеченные в прошлом цикле и ещё не подметённые. Их метки ещё действительны
+    SpanList unswept_[kNumSizeClasses];
+    SpanList unswept_large_;
+    // Спаны, которые подметаются без блокировки кучи; учитываются в unswept_count_
+    SpanList sweeping_;
+    std::condition_variable sweeping_cv_;
+    std::atomic<size_t> unswept_count_{0};
+    // Растёт в StartSweep; спаны с другим swept_epoch_ ещё не подметены
+    std::atomic<uint32_t> sweep_epoch_{0};
+    SpanList free_pages_;                 // пустые страницы, ещё занимающие физическую память
+    SpanList released_pages_;             // пустые страницы, уже возвращённые системе
+    std::atomic<size_t> idle_bytes_{0};   // объём free_pages_
+    // Спаны, опустошённые уплотнением: индекс страниц держит их до обновления ссылок
+    SpanList evacuated_;
+    PageMap page_map_;
+    DeadObjectHook on_dead_;
+
+    std::mutex caches_mutex_;
+    ThreadCache *caches_{nullptr};
+    // Пока идёт маркировка, новые объекты сразу получают метку. Меняется только под
+    // блокировками всех кэшей и кучи, а читается под одной из них
+    std::atomic<bool> allocate_black_{false};
+    // Сколько байт выдано за всё время; растёт при пополнении кэшей и выделении больших объектов
+    std::atomic<size_t> allocated_bytes_{0};
+    std::atomic<uint64_t> objects_freed_{0};
+    std::atomic<uint64_t> bytes_freed_{0};
+    std::atomic<uint64_t> sweep_ns_{0};
+
+    Span* AllocateSpan(size_t size_class);
+    void ReleaseSpan(Span *span);
+    void ReleasedSpanLocked(Span *span);
+    void GrowArena();
+    void* AllocateLarge(size_t size, uint16_t finalizer, uint16_t type);
+    void FreeLarge(Span *span);
+    void InitBitmaps(Span *span);
+    void FreeBitmaps(Span *span);
+    void FreeLocked(Span *span, uint32_t index);
+    void RefileLocked(Span *span);
+    Span* PartialSpanLocked(size_t size_class);
+    void RefillLocked(ThreadCache::Bin &bin, size_t size_class, size_t want);
+    void* InitSlot(Span *span, void *ptr, size_t size, uint16_t finalizer, uint16_t type);
+    void FlushLocked(ThreadCache &cache);
+    ThreadCache* LocalCache();
+    void LockCaches();
+    void UnlockCaches();
+    void SweepSpanLocked(Span *span, bool run_hooks);
+    void CountSwept(uint64_t objects, uint64_t bytes, std::chrono::steady_clock::time_point started);
+    bool ReleaseDead(Span *span, uint32_t index);
+    Span* TakeUnsweptLocked();
+    bool SweepOneLocked();
+    void* TakeSlotLocked(size_t size_class);
+    void EvacuateSpanLocked(Span *span);
+public:
+    Heap() = default;
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    // Вызывается при подметании для каждого мёртвого объекта перед освобождением слота
+    void SetDeadObjectHook(DeadObjectHook hook) {
+        on_dead_ = std::move(hook);
+    }
+
+    void* Allocate(size_t size, uint16_t finalizer, uint16_t type);
+    // Вызывается при завершении потока: возвращает его слоты и удаляет кэш
+    void DetachCache(ThreadCache *cache);
+    // Освобождает объект, слот которого хук оставил занятым на время финализации
+    void FreeFinalized(Span *span, uint32_t index);
+    Span* SpanOf(const void *ptr) const {
+        return page_map_.Get(ptr);
+    }
+    ObjectRef Find(const void *ptr) const {
+        Span *span = page_map_.Get(ptr);
+        return span ? ObjectRef{span, span->SlotIndex(ptr)} : ObjectRef{};
+    }
+    // Начало слота, внутрь которого указывает ptr; nullptr, если ptr не в куче
+    void* BaseOf(const void *ptr) const {
+        ObjectRef ref = Find(ptr);
+        if (!ref || ref.index_ >= ref.span_->slot_count_) return nullptr;
+        return ref.span_->SlotAddress(ref.index_);
+    }
+    // Живой объект, внутрь которого указывает произвольное слово, — для консервативного поиска корней.
+    // Слот, ждущий финализатора, уже мёртв
+    ObjectRef FindAllocated(const void *ptr) const {
+        ObjectRef ref = Find(ptr);
+        if (!ref || ref.index_ >= ref.span_->slot_count_) return {};
+        if (!ref.span_->IsAllocated(ref.index_) || ref.span_->IsFinalizing(ref.index_)) return {};
+        return ref;
+    }
+    // Живые объекты; у неподметённых спанов считаются отмеченные
+    size_t ObjectCount();
+    size_t AllocatedBytes() const {
+        return allocated_bytes_.load(std::memory_order_relaxed);
+    }
+    SweepCounters Swept() const {
+        return {objects_freed_.load(std::memory_order_relaxed), bytes_freed_.load(std::memory_order_relaxed),
+                sweep_ns_.load(std::memory_order_relaxed)};
+    }
+
+    // Включается перед маркировкой; выключает его StartSweep или SweepYoung
+    void StartAllocatingBlack();
+    // Подметание после малой сборки: освобождает неотмеченные молодые объекты, выжившим
+    // увеличивает возраст и повышает достигших promote_age. Возвращает повышенные объекты.
+    // Неподметённых спанов к этому моменту быть не должно
+    std::vector<void*> SweepYoung(uint8_t promote_age);
+    // Переводит все занятые спаны в неподметённые и перестаёт выделять объекты отмеченными.
+    // Списки переносятся целиком, так что пауза не зависит от размера кучи. Молодые объекты
+    // повышаются, когда подметается их спан; до того IsYoung считает их старыми
+    void StartSweep();
+    // Подметает не больше max_spans спанов, возвращает false, если взять не удалось ни одного:
+    // оставшиеся неподметённые тогда уже у фонового подметальщика (sweeping_)
+    bool SweepSome(size_t max_spans);
+    // Подметает один спан, вызывая хук мёртвых объектов вне блокировки кучи,
+    // чтобы финализаторы не задерживали аллокацию. Возвращает false, если брать больше нечего
+    bool SweepOneConcurrent();
+    void FinishSweep();
+    bool HasUnswept() const {
+        return unswept_count_.load(std::memory_order_relaxed) > 0;
+    }
+    bool IsSwept(const Span *span) const {
+        return span->swept_epoch_.load(std::memory_order_acquire) == sweep_epoch_.load(std::memory_order_relaxed);
+    }
+    // Для барьеров, работающих параллельно с ленивым подметанием: биты неподметённого спана
+    // остались с прошлого цикла, а все его объекты уже старые
+    bool IsYoung(ObjectRef ref) const {
+        return IsSwept(ref.span_) && ref.IsYoung();
+    }
+
+    // Уплотнение. Вызывается при остановленных мутаторах после полного подметания.
+    // Переносит объекты из спанов, занятых не больше чем на max_occupancy_percent, в другие
+    // спаны того же класса, если это освобождает хотя бы один спан. Спаны с объектами,
+    // для которых pinned вернул true, и с ждущими финализации не трогаются.
+    // Возвращает число опустошённых спанов
+    size_t Evacuate(size_t max_occupancy_percent, const std::function<bool(void*)> &pinned);
+    // Новый адрес перенесённого объекта (с тем же смещением внутри него) или сам ptr
+    void* Forwarded(void *ptr) const {
+        Span *span = page_map_.Get(ptr);
+        if (!span || !span->forward_) return ptr;
+        uint32_t index = span->SlotIndex(ptr);
+        void *target = index < span->slot_count_ ? span->forward_[index] : nullptr;
+        if (!target) return ptr;
+        return static_cast<char*>(target) + (static_cast<char*>(ptr) - static_cast<char*>(span->SlotAddress(index)));
+    }
+    // Передаёт fn каждый занятый объект, включая ждущие финализации
+    void ForEachObject(const std::function<void(void *ptr, ObjectMeta &meta)> &fn);
+    // Отдаёт опустошённые спаны системе и забывает адреса переездов. Возвращает число байт
+    size_t FinishEvacuation();
+
+    // Возвращает системе страницы спанов, пустующих не меньше min_idle. Сам madvise идёт
+    // без блокировки кучи. Возвращает число байт
+    size_t Scavenge(std::chrono::nanoseconds min_idle);
+    // Пустые страницы, которые ещё не возвращены системе
+    size_t IdleBytes() const {
+        return idle_bytes_.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -1,61 +1,237 @@
 #ifndef GC_IMPL_H
 #define GC_IMPL_H
 
-#include <unordered_map>
 #include <unordered_set>
 #include <deque>
+#include <functional>
 #include <mutex>
 #include <shared_mutex>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdlib>
 #include <thread>
+#include <vector>
 
 #include "gc.h"
+#include "gc_heap.h"
+#include "gc_edges.h"
+#include "gc_mutator.h"
+#include "gc_parallel_mark.h"
+#include "gc_roots.h"
+#include "gc_stacks.h"
+#include "gc_snapshot.h"
+#include "gc_trace.h"
 
 inline void DefaultFinalizer(void *ptr, size_t size) {
     return;
 }
 
-enum class Color {
-    White, Gray, Black
-};
-
 class GarbageCollector {
-    struct Allocation {
+    static constexpr size_t kMaxFinalizers = size_t{1} << 16;
+    static constexpr size_t kMaxTypes = size_t{1} << 16;
+    static constexpr size_t kBackgroundSweepSpans = 64;
+    static constexpr size_t kFinalizerBatch = 256;
+    // Часы в шаге с бюджетом времени опрашиваются раз в столько единиц работы (объектов и рёбер)
+    static constexpr size_t kClockCheckWork = 256;
+    static constexpr size_t kBudgetSweepSpans = 4;
+    // Прирост кучи между циклами не меньше этого, сколько бы ни было живых данных
+    static constexpr size_t kMinHeapGrowth = size_t{4} << 20;
+    // Мутатор сверяется с пейсером раз в столько выделенных байт
+    static constexpr size_t kAssistBytes = size_t{64} << 10;
+    static constexpr uint8_t kPromotionAge = 2;
+    static constexpr size_t kDefaultNurseryBytes = size_t{8} << 20;
+    static constexpr size_t kInitialStackRoots = 4096;
+    // Уплотнение выносит объекты из спанов, занятых не больше чем на столько процентов
+    static constexpr size_t kCompactOccupancyPercent = 50;
+    static constexpr int kDefaultScavengeDelayMs = 1000;
+
+    // Работа маркировки. Каждый воркер копит свою копию, в общий итог цикла она сливается в конце фазы
+    struct alignas(64) MarkWork {
+        uint64_t objects_{0};
+        uint64_t bytes_{0};
+        uint64_t edges_{0};
+
+        MarkWork& operator+=(const MarkWork &other) {
+            objects_ += other.objects_;
+            bytes_ += other.bytes_;
+            edges_ += other.edges_;
+            return *this;
+        }
+    };
+
+    // Сколько может сделать один шаг маркировки. Исчерпание любого из пределов завершает шаг
+    struct MarkBudget {
+        size_t objects_{SIZE_MAX};
+        size_t edges_{SIZE_MAX};
+        std::chrono::steady_clock::time_point deadline_{std::chrono::steady_clock::time_point::max()};
+    };
+
+    Heap heap_;
+    EdgeTable edges_;
+
+    std::atomic<FinalizerT> finalizers_[kMaxFinalizers]{DefaultFinalizer};
+    std::atomic<size_t> finalizers_count_{1};
+    std::mutex finalizers_mutex_;
+
+    // Раскладка типизированного объекта: смещения полей-указателей
+    struct TypeInfo {
         size_t size_;
-        void *ptr_;
-        Color color_;
-        std::unordered_set<void*> edges;
-        FinalizerT finalizer_;
+        std::vector<uint32_t> offsets_;
     };
+    std::atomic<const TypeInfo*> types_[kMaxTypes]{};
+    std::atomic<size_t> types_count_{1};
+    std::mutex types_mutex_;
 
-    std::unordered_set<void *> roots_;
-    std::shared_mutex roots_mutex_;
+    // Мёртвые объекты с пользовательским финализатором; их слоты освобождаются после вызова
+    std::deque<void*> finalization_queue_;
+    std::mutex finalization_mutex_;
+    std::condition_variable finalization_cv_;
+    std::atomic<bool> finalizer_thread_running_{false};
+    std::thread finalizer_thread_;
 
-    std::unordered_map<void *, Allocation> allocations_;
-    std::shared_mutex allocations_mutex_;
+    RootSet roots_;
+
+    // Консервативные корни со стеков зарегистрированных потоков и хэндлы gc::Root. Буфер готовится
+    // заранее: пока потоки стоят, выделять память нельзя
+    StackScanner stacks_;
+    std::vector<void*> stack_roots_;
+    size_t stack_roots_reserve_{kInitialStackRoots};
+
+    // Объекты, которые уплотнение не двигает, сверх корней
+    std::unordered_set<void*> pinned_;
+    std::mutex pinned_mutex_;
 
     std::deque<void*> gray_objects_;
     std::mutex gray_mutex_;
+    ParallelMarker marker_;
+
+    // Старые объекты, у которых могут быть молодые дети
+    std::vector<void*> remembered_;
+    std::mutex remembered_mutex_;
+    // Идёт малая сборка: обход не выходит за молодое поколение
+    std::atomic<bool> minor_marking_{false};
+    std::atomic<size_t> nursery_bytes_{kDefaultNurseryBytes};
+    std::atomic<size_t> last_minor_end_{0};
+    // Вызывается сборщиком малой сборки между паузами, при работающих мутаторах
+    std::function<void()> minor_mark_hook_;
 
     std::atomic<bool> gc_in_progress_{false};
     std::shared_mutex gc_mutex_;
 
+    // Мутаторы останавливаются только на снимок корней в начале цикла и на завершение маркировки
+    MutatorRegistry mutators_;
+    GcPauseInfo current_pauses_{};
+    std::chrono::steady_clock::time_point mark_started_;
+
+    // Телеметрия текущего цикла; меняется под gc_mutex_
+    MarkWork cycle_work_;
+    double cycle_allocation_rate_{0.0};
+    size_t last_report_allocated_{0};
+    std::chrono::steady_clock::time_point last_report_time_{std::chrono::steady_clock::now()};
+    Heap::SweepCounters reported_sweep_;
+    uint64_t reported_finalize_ns_{0};
+    uint64_t reported_finalized_{0};
+    uint64_t reported_barrier_hits_{0};
+    // Счётчики, которые двигают мутаторы и поток финализации
+    std::atomic<uint64_t> barrier_hits_{0};
+    std::atomic<uint64_t> finalize_ns_{0};
+    std::atomic<uint64_t> objects_finalized_{0};
+    std::atomic<uint64_t> pause_histogram_[GC_PAUSE_BUCKETS]{};
+    std::atomic<uint64_t> pause_max_ns_{0};
+    // Итоги завершённых циклов, паузы последнего и ещё не переданные обратному вызову циклы
+    GcStats totals_{};
+    GcPauseInfo last_pauses_{};
+    std::vector<GcCycleStats> unreported_cycles_;
+    GcCycleCallback cycle_callback_{nullptr};
+    void *cycle_callback_arg_{nullptr};
+    std::mutex stats_mutex_;
+
+    // Поток сборщика для gc_collect_concurrent
+    std::thread collector_thread_;
+    std::condition_variable collector_cv_;
+    std::mutex collector_mutex_;
+    bool collector_stop_{false};
+    uint64_t collections_requested_{0};
+    uint64_t collections_done_{0};
+
+    std::atomic<GcSweepMode> sweep_mode_{GC_SWEEP_EAGER};
+    std::thread sweeper_thread_;
+    std::condition_variable sweeper_cv_;
+    std::mutex sweeper_mutex_;
+    bool sweeper_stop_{false};
+    bool sweep_requested_{false};
+
     std::atomic<bool> incremental_mark_{false};
-    std::deque<void*>::iterator mark_iterator_;
     size_t steps_per_increment_{100};
 
+    // Пейсер. Пороги выражены в значениях heap_.AllocatedBytes()
+    std::atomic<int> gc_percent_{100};
+    std::atomic<size_t> next_trigger_{kMinHeapGrowth / 8 * 7};
+    std::atomic<size_t> heap_goal_{kMinHeapGrowth};
+    std::atomic<double> assist_work_per_byte_{0.0};
+    size_t last_marked_bytes_{0};
+    // AllocatedBytes() в начале маркировки: выделенное позже считается живым
+    size_t mark_start_allocated_{0};
+    size_t last_cycle_end_{0};
+
     std::atomic<bool> background_collector_running_{false};
     std::thread background_collector_thread_;
     int background_collector_interval_{100};
+    // Сколько пустая страница лежит без дела, прежде чем фоновый сборщик вернёт её системе; < 0 — никогда
+    std::atomic<int> scavenge_delay_ms_{kDefaultScavengeDelayMs};
     std::condition_variable background_cv_;
     std::mutex background_mutex_;
 
-    GarbageCollector() = default;
-    void RemoveRoot(void *ptr);
+    // Запись трассы для gc_replay. Сборки фонового сборщика записываются, только если он вызвал
+    // CollectGarbage или CollectMinor; инкрементальные циклы и уплотнение в трассу не попадают
+    TraceRecorder trace_;
+
+    GarbageCollector();
+    ~GarbageCollector();
+    uint16_t FinalizerIndex(FinalizerT finalizer);
+    bool ReleaseObject(Span *span, uint32_t index);
+    void InsertEdge(void *parent, ObjectMeta *parent_meta, void *child);
+    void RemoveEdge(void *parent, ObjectMeta *parent_meta, void *child);
+    void* Resolve(void *ptr) const;
+    std::vector<void*> ResolveAll(void *const *ptrs, size_t count) const;
+    bool Shade(void *ptr, ObjectRef ref);
+    void ShadeDeleted(void *ptr);
+    bool NeedsInsertBarrier(ObjectRef parent_ref) const;
+    void ShadeInserted(ObjectRef parent_ref, void *child);
+    void ShadeMany(void *const *ptrs, size_t count);
+    void InsertEdges(void *parent, void *const *children, size_t count);
+    void RememberEdge(void *parent, ObjectRef parent_ref, void *child);
+    static void* LoadField(void *ptr, uint32_t offset);
+    bool HasYoungChild(void *ptr, ObjectRef ref);
+    void RebuildRememberedSet(const std::vector<void*> &promoted);
+    bool NurseryFull() const;
+    void ScavengeIdle();
+    template <class Push>
+    size_t ScanObject(void *ptr, Push &&push, MarkWork &work);
+    void DrainGrayObjects(MarkBudget budget);
+    void DrainGrayConcurrently();
+    void CollectStackRoots();
+    void BeginMarking();
+    void UpdatePacerTargets();
+    bool PacerTriggered() const;
+    void AccountAllocation(size_t size);
+    void MarkAssist(size_t bytes);
+    std::chrono::steady_clock::time_point StopMutators();
+    uint64_t ResumeMutators(std::chrono::steady_clock::time_point stopped);
+    void MeasureAllocationRate();
+    void PublishCycle(bool minor);
+    void AfterCycle();
     void Mark();
+    void FinishMarking();
     void Sweep();
+    bool StepMarkLocked(const MarkBudget &budget, bool sweep_all);
+    void StopSweeper();
+    void StopCollectorThread();
+    void CollectorLoop();
+    void SweeperLoop();
+    void FinalizerThreadLoop();
+    void RunPendingFinalizers();
 public:
     static GarbageCollector& GetInstance() {
         static GarbageCollector instance;
@@ -64,24 +240,61 @@ public:
     GarbageCollector(const GarbageCollector&) = delete;
     GarbageCollector& operator=(const GarbageCollector&) = delete;
 
-    void AddAllocation(void *ptr, size_t size, FinalizerT finalizer=DefaultFinalizer);
-    void AddRootAllocation(void *ptr, size_t size, FinalizerT finalizer=DefaultFinalizer);
-    void AddAllocationWithParent(void *ptr, size_t size, void *parent, FinalizerT finalizer=DefaultFinalizer);
+    void* Allocate(size_t size, FinalizerT finalizer=DefaultFinalizer);
+    void* AllocateRoot(size_t size, FinalizerT finalizer=DefaultFinalizer);
+    void* AllocateWithParent(size_t size, void *parent, FinalizerT finalizer=DefaultFinalizer);
+    void* AllocateTyped(uint32_t type);
+    uint32_t RegisterType(size_t size, const size_t *offsets, size_t count);
+    void StoreField(void *parent, void **field, void *value);
     void AddRoot(void *ptr);
     void DeleteRoot(void *ptr);
     void AddEdge(void *parent, void *child);
     void DeleteEdge(void *parent, void *child);
     void SwapEdge(void *parent, void *child1, void *child2);
+    void AddEdges(void *parent, void *const *children, size_t count);
+    void AddEdgesPairs(const GcEdge *edges, size_t count);
+    void AddRoots(void *const *ptrs, size_t count);
+    void DeleteRoots(void *const *ptrs, size_t count);
+    void PushHandle(void *ptr);
+    void PopHandle();
     void CollectGarbage();
+    size_t Compact();
+    void Pin(void *ptr);
+    void Unpin(void *ptr);
+    void CollectMinor();
+    void CollectConcurrent();
+    void WaitForCollection();
+    GcPauseInfo LastPauses();
+    GcStats Stats();
+    void SetCycleCallback(GcCycleCallback callback, void *arg);
+    void SetNurserySize(size_t bytes);
+    bool RegisterThread();
+    void UnregisterThread();
     void BlockCollect();
     void UnlockCollect();
 
     void StartIncrementalMark();
     void StepMark();
+    bool StepMarkFor(uint64_t budget_ns);
+    bool StepMarkWork(size_t edges);
     bool IsMarking() const;
     void FinishIncrementalMark();
     void SetStepsPerIncrement(size_t steps);
+    void SetMarkThreads(size_t threads);
+    void SetSweepMode(GcSweepMode mode);
+
+    size_t RunFinalizers(size_t max);
+    void StartFinalizerThread();
+    void StopFinalizerThread();
 
+    void SetGcPercent(int percent);
+    void SetScavengeDelay(int delay_ms);
+    size_t ReleaseMemory();
+    bool StartTrace(const char *path);
+    size_t StopTrace();
+    // По адресу начинается выделенный и ещё не освобождённый объект
+    bool IsAllocated(const void *ptr);
+    bool DumpHeap(const char *path);
     void StartBackgroundCollector(size_t steps, int interval_ms);
     void StopBackgroundCollector();
     bool IsBackgroundCollectorRunning() const;
@@ -89,6 +302,8 @@ public:
 
     // FOR TESTING
     size_t GetAllocationsCount();
+    size_t GetIdleBytes() const;
+    void SetMinorMarkHook(std::function<void()> hook);
 };
 
 #endif
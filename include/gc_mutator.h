@@ -0,0 +1,144 @@
+#ifndef GC_MUTATOR_H
+#define GC_MUTATOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "gc_spinlock.h"
+
+// Стек хэндлов gc::Root одного потока, без общих блокировок. Сборщик читает его в паузе, а владелец
+// в это время может снимать хэндлы, поэтому размер публикуется после записи слота.
+// Лишний прочитанный слот только продлевает жизнь объекта до следующего цикла
+class HandleStack {
+    static constexpr size_t kChunkSize = 256;
+
+    struct Chunk {
+        std::atomic<void*> slots_[kChunkSize];
+        std::atomic<Chunk*> next_{nullptr};
+        Chunk *prev_{nullptr};
+    };
+
+    Chunk first_;
+    Chunk *current_{&first_};
+    size_t used_{0};
+    std::atomic<size_t> size_{0};
+public:
+    HandleStack() = default;
+    ~HandleStack() {
+        for (Chunk *chunk = first_.next_.load(); chunk; ) {
+            Chunk *next = chunk->next_.load();
+            delete chunk;
+            chunk = next;
+        }
+    }
+    HandleStack(const HandleStack&) = delete;
+    HandleStack& operator=(const HandleStack&) = delete;
+
+    // Снятые куски остаются за потоком, в установившемся режиме аллокаций нет
+    void Push(void *ptr) {
+        if (used_ == kChunkSize) {
+            Chunk *next = current_->next_.load(std::memory_order_relaxed);
+            if (!next) {
+                next = new Chunk;
+                next->prev_ = current_;
+                current_->next_.store(next, std::memory_order_release);
+            }
+            current_ = next;
+            used_ = 0;
+        }
+        current_->slots_[used_++].store(ptr, std::memory_order_relaxed);
+        size_.store(size_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    // Возвращает снятый указатель
+    void* Pop() {
+        if (used_ == 0) {
+            current_ = current_->prev_;
+            used_ = kChunkSize;
+        }
+        --used_;
+        size_.store(size_.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+        return current_->slots_[used_].load(std::memory_order_relaxed);
+    }
+
+    template <class Fn>
+    void ForEach(Fn &&fn) const {
+        size_t size = size_.load(std::memory_order_acquire);
+        for (const Chunk *chunk = &first_; size; chunk = chunk->next_.load(std::memory_order_acquire)) {
+            size_t count = std::min(size, kChunkSize);
+            for (size_t i = 0; i < count; ++i) {
+                fn(chunk->slots_[i].load(std::memory_order_relaxed));
+            }
+            size -= count;
+        }
+    }
+};
+
+// Реестр потоков-мутаторов. Каждая операция мутатора над графом выполняется под спинлоком
+// своего потока — без конкуренции, пока сборщику не понадобится остановить всех разом
+// (brlock: вход дешёвый, остановка обходит все потоки)
+class MutatorRegistry {
+public:
+    struct Mutator {
+        SpinLock lock_;
+        HandleStack handles_;
+        Mutator *next_{nullptr};
+        Mutator *prev_{nullptr};
+    };
+private:
+    std::mutex mutex_;
+    Mutator *head_{nullptr};
+    // Поднят, пока сборщик останавливает мутаторов. Спинлок не честный: поток, входящий
+    // в операции без передышки, иначе перехватывал бы свой лок раньше сборщика
+    std::atomic<bool> stopping_{false};
+public:
+    MutatorRegistry() = default;
+    MutatorRegistry(const MutatorRegistry&) = delete;
+    MutatorRegistry& operator=(const MutatorRegistry&) = delete;
+
+    // Запись текущего потока, регистрируется при первом обращении
+    Mutator& Local();
+    void Detach(Mutator *mutator);
+
+    void Enter(Mutator &mutator) {
+        while (true) {
+            mutator.lock_.lock();
+            if (!stopping_.load(std::memory_order_relaxed)) return;
+            mutator.lock_.unlock();
+            while (stopping_.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    void Exit(Mutator &mutator) {
+        mutator.lock_.unlock();
+    }
+
+    // Дожидается, пока все мутаторы закончат текущие операции, и не пускает их в новые
+    void StopAll();
+    void ResumeAll();
+    // Только между StopAll и ResumeAll: список потоков тогда не меняется
+    template <class Fn>
+    void ForEachStopped(Fn &&fn) {
+        for (Mutator *mutator = head_; mutator; mutator = mutator->next_) {
+            fn(*mutator);
+        }
+    }
+};
+
+class MutatorScope {
+    MutatorRegistry &registry_;
+    MutatorRegistry::Mutator &mutator_;
+public:
+    explicit MutatorScope(MutatorRegistry &registry) : registry_(registry), mutator_(registry.Local()) {
+        registry_.Enter(mutator_);
+    }
+    ~MutatorScope() {
+        registry_.Exit(mutator_);
+    }
+    MutatorScope(const MutatorScope&) = delete;
+    MutatorScope& operator=(const MutatorScope&) = delete;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef GC_PARALLEL_MARK_H
+#define GC_PARALLEL_MARK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Дек Чейза-Лева: владелец кладёт и забирает с нижнего конца без блокировок,
+// остальные потоки воруют с верхнего конца через CAS
+class WorkStealingDeque {
+    struct Array {
+        int64_t capacity_;
+        std::unique_ptr<std::atomic<void*>[]> items_;
+
+        explicit Array(int64_t capacity)
+            : capacity_(capacity), items_(new std::atomic<void*>[capacity]) {}
+        void* Get(int64_t index) const {
+            return items_[index & (capacity_ - 1)].load(std::memory_order_relaxed);
+        }
+        void Put(int64_t index, void *item) {
+            items_[index & (capacity_ - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_;
+    // Старые массивы могут ещё читаться ворами, поэтому освобождаются только между фазами маркировки
+    std::vector<std::unique_ptr<Array>> retired_;
+
+    Array* Grow(Array *array, int64_t top, int64_t bottom);
+public:
+    WorkStealingDeque();
+    ~WorkStealingDeque();
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    void Push(void *item);
+    void* Pop();
+    void* Steal();
+    bool Empty() const;
+    void ReleaseRetired();
+};
+
+// Пул потоков маркировки. Вызывающий поток работает как нулевой воркер.
+// По номеру воркера scan может вести свои счётчики без общих атомиков
+class ParallelMarker {
+public:
+    using ScanFn = std::function<void(void *object, WorkStealingDeque &local, size_t worker)>;
+private:
+    std::vector<std::unique_ptr<WorkStealingDeque>> deques_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    uint64_t generation_{0};
+    size_t active_{0};
+    bool stop_{false};
+
+    const std::vector<void*> *seeds_{nullptr};
+    ScanFn scan_;
+    std::atomic<size_t> idle_{0};
+
+    void ThreadLoop(size_t id, uint64_t seen);
+    void Work(size_t id);
+    void* StealFromOthers(size_t id);
+    bool AnyWork() const;
+    void StopThreads();
+public:
+    ParallelMarker();
+    ~ParallelMarker();
+
+    void SetThreads(size_t threads);
+    size_t Threads() const {
+        return deques_.size();
+    }
+    // Раздаёт seeds воркерам и возвращается, когда все деки опустели
+    void Run(const std::vector<void*> &seeds, ScanFn scan);
+};
+
+#endif
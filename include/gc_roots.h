@@ -0,0 +1,46 @@
+#ifndef GC_ROOTS_H
+#define GC_ROOTS_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+
+#include "gc_spinlock.h"
+
+// Множество явных корней, разбитое на шарды по адресу. Потоки, добавляющие и снимающие
+// разные корни, почти всегда берут разные блокировки; сборщик обходит шарды по очереди
+class RootSet {
+    static constexpr unsigned kShardBits = 6;
+    static constexpr size_t kShards = size_t{1} << kShardBits;
+
+    struct alignas(64) Shard {
+        SpinLock lock_;
+        std::unordered_set<void*> roots_;
+    };
+
+    Shard shards_[kShards];
+
+    static size_t ShardIndex(const void *ptr) {
+        return AddressStripe(ptr, kShardBits);
+    }
+    template <class Fn>
+    void ForEachShardOf(void *const *ptrs, size_t count, Fn &&fn);
+public:
+    void Add(void *ptr);
+    void Remove(void *ptr);
+    // Пачка раскладывается по шардам, каждый блокируется один раз
+    void AddMany(void *const *ptrs, size_t count);
+    void RemoveMany(void *const *ptrs, size_t count);
+
+    template <class Fn>
+    void ForEach(Fn &&fn) {
+        for (Shard &shard : shards_) {
+            std::lock_guard<SpinLock> lock(shard.lock_);
+            for (void *ptr : shard.roots_) {
+                fn(ptr);
+            }
+        }
+    }
+};
+
+#endif
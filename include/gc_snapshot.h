@@ -0,0 +1,72 @@
+#ifndef GC_SNAPSHOT_H
+#define GC_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Снимок кучи для gc_dump_heap: заголовок kSnapshotMagic и поток записей — байт вида и операнды
+// в varint. Адреса записываются зигзагом как разность с предыдущим адресом в файле
+enum class SnapshotRecord : uint8_t {
+    kObject = 1,        // address, size, type, finalizer, count, children
+    kRoot,              // address
+    kStackRoot,         // address; найден консервативным просмотром стеков
+};
+
+constexpr char kSnapshotMagic[8] = {'G', 'C', 'H', 'E', 'A', 'P', '0', '1'};
+
+// Копит снимок в памяти: во время паузы нет ввода-вывода, файл пишется уже после неё
+class SnapshotWriter {
+    std::string data_;
+    uint64_t last_address_{0};
+
+    void WriteVarint(uint64_t value);
+    void WriteAddress(const void *ptr);
+public:
+    SnapshotWriter();
+
+    void Object(const void *ptr, size_t size, uint32_t type, uint32_t finalizer, const std::vector<void*> &children);
+    void Root(SnapshotRecord record, const void *ptr);
+    bool Save(const std::string &path) const;
+};
+
+// Снимок, прочитанный из файла. Объекты упорядочены по адресу, рёбра и корни — индексы объектов.
+// Рёбра в объекты, которых нет в снимке, отбрасываются
+struct HeapSnapshot {
+    std::vector<uint64_t> addresses_;
+    std::vector<uint64_t> sizes_;
+    std::vector<uint32_t> types_;
+    std::vector<uint32_t> finalizers_;
+    // Дети объекта i — edges_[edge_begin_[i]..edge_begin_[i + 1])
+    std::vector<uint64_t> edge_begin_;
+    std::vector<uint32_t> edges_;
+    std::vector<uint32_t> roots_;
+    std::vector<uint32_t> stack_roots_;
+
+    size_t ObjectCount() const {
+        return addresses_.size();
+    }
+    // Индекс объекта по адресу начала; ObjectCount(), если такого нет
+    size_t Find(uint64_t address) const;
+};
+
+bool ReadSnapshot(const std::string &path, HeapSnapshot &snapshot);
+
+// Дерево доминаторов над снимком. Все корни подвешены к виртуальной вершине с индексом ObjectCount()
+struct DominatorTree {
+    static constexpr uint32_t kUnreachable = UINT32_MAX;
+
+    // Непосредственный доминатор объекта; kUnreachable, если объект недостижим
+    std::vector<uint32_t> idom_;
+    // Объём, который освободится вместе с объектом: он сам и всё, что он доминирует; у недостижимых 0.
+    // Последний элемент — объём всех достижимых объектов
+    std::vector<uint64_t> retained_;
+    size_t reachable_{0};
+};
+
+// Алгоритм Ленгауэра — Тарьяна со сжатием путей, O(m log n). Обход итеративный, без рекурсии,
+// поэтому годится и для снимков в десятки миллионов объектов
+DominatorTree ComputeDominators(const HeapSnapshot &snapshot);
+
+#endif
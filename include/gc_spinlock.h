@@ -0,0 +1,38 @@
+#ifndef GC_SPINLOCK_H
+#define GC_SPINLOCK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+// Короткие критические секции (изменение списка рёбер одного объекта) дешевле защищать спинлоком, чем мьютексом
+class SpinLock {
+    std::atomic<bool> locked_{false};
+public:
+    void lock() {
+        for (size_t spins = 0; locked_.exchange(true, std::memory_order_acquire); ) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                if (++spins > 64) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    bool try_lock() {
+        return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+};
+
+// Номер полосы блокировок для адреса из 2^bits полос. Адреса объектов часто кратны крупным
+// степеням двойки, поэтому адрес перемешивается умножением, а номер берётся из старших битов
+inline size_t AddressStripe(const void *ptr, unsigned bits) {
+    return (reinterpret_cast<uintptr_t>(ptr) * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+#endif
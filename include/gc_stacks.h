@@ -0,0 +1,104 @@
+#ifndef GC_STACKS_H
+#define GC_STACKS_H
+
+#include <atomic>
+#include <csetjmp>
+#include <mutex>
+#include <pthread.h>
+
+// Консервативный поиск корней: стеки и регистры зарегистрированных потоков. Поток
+// останавливается сигналом; обработчик сбрасывает регистры в jmp_buf и ждёт, пока
+// сборщик просмотрит его стек. Регистры прерванного кода ядро к тому же кладёт на стек
+// в кадр сигнала, выше обработчика
+class StackScanner {
+public:
+    struct ThreadStack {
+        StackScanner *owner_{nullptr};
+        pthread_t thread_{};
+        char *stack_top_{nullptr};
+        char *stack_low_{nullptr};
+        jmp_buf registers_;
+        std::atomic<bool> suspended_{false};
+        ThreadStack *next_{nullptr};
+        ThreadStack *prev_{nullptr};
+    };
+private:
+    std::mutex mutex_;
+    ThreadStack *head_{nullptr};
+    std::atomic<bool> empty_{true};
+    std::atomic<uint64_t> resume_epoch_{0};
+
+    static void SuspendHandler(int);
+    static void InstallHandler();
+    // Граница, ниже которой в кадре вызывающей функции ничего нет
+    static char* StackLow();
+    // Сбрасывает регистры вызывающих в свой кадр и вызывает fn, пока этот кадр жив.
+    // setjmp здесь не нужен, а значит, и нет локальных переменных, живущих через него
+    template <class Fn>
+    __attribute__((noinline)) static void WithRegistersSpilled(Fn &&fn) {
+        __builtin_unwind_init();
+        fn();
+    }
+    void SuspendOthers(ThreadStack *self);
+    void ResumeOthers(ThreadStack *self);
+
+    template <class Visit>
+    static bool ScanRange(const char *begin, const char *end, Visit &visit) {
+        auto *word = reinterpret_cast<void* const*>(
+            (reinterpret_cast<uintptr_t>(begin) + sizeof(void*) - 1) & ~(sizeof(void*) - 1));
+        for (; reinterpret_cast<const char*>(word + 1) <= end; ++word) {
+            if (!visit(*word)) return false;
+        }
+        return true;
+    }
+public:
+    StackScanner() = default;
+    StackScanner(const StackScanner&) = delete;
+    StackScanner& operator=(const StackScanner&) = delete;
+
+    // Возвращает false, если границы стека узнать не удалось
+    bool RegisterCurrentThread();
+    void UnregisterCurrentThread();
+    bool Empty() const {
+        return empty_.load(std::memory_order_relaxed);
+    }
+
+    // Останавливает зарегистрированные потоки и передаёт visit каждое слово их стеков и регистров.
+    // Пока потоки стоят, они могут держать любые блокировки, в том числе malloc, поэтому
+    // visit не должен ни выделять память, ни блокироваться. Если visit вернул false, просмотр
+    // прерывается, потоки отпускаются и возвращается false
+    template <class Visit>
+    bool ScanAll(Visit &&visit);
+};
+
+template <class Visit>
+bool StackScanner::ScanAll(Visit &&visit) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ThreadStack *self = nullptr;
+    for (ThreadStack *stack = head_; stack; stack = stack->next_) {
+        if (pthread_equal(stack->thread_, pthread_self())) {
+            self = stack;
+        }
+    }
+
+    // Свой стек просматривается без сигнала: регистры лежат в кадре WithRegistersSpilled,
+    // а граница стека берётся ниже него
+    bool complete = true;
+    WithRegistersSpilled([&] {
+        if (self) {
+            self->stack_low_ = StackLow();
+        }
+        SuspendOthers(self);
+        for (ThreadStack *stack = head_; stack && complete; stack = stack->next_) {
+            if (stack != self) {
+                const char *regs = reinterpret_cast<const char*>(&stack->registers_);
+                complete = ScanRange(regs, regs + sizeof(jmp_buf), visit);
+            }
+            complete = complete && ScanRange(stack->stack_low_, stack->stack_top_, visit);
+        }
+        ResumeOthers(self);
+    });
+    return complete;
+}
+
+#endif
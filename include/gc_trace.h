@@ -0,0 +1,144 @@
+#ifndef GC_TRACE_H
+#define GC_TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Двоичная трасса вызовов сборщика: заголовок kTraceMagic и поток событий — байт операции
+// и операнды в varint. Объект обозначается номером. Новый объект получает следующий номер неявно,
+// а номер в операнде записывается зигзагом как разность с последним упомянутым: соседние
+// события обычно касаются одних и тех же или только что созданных объектов
+enum class TraceOp : uint8_t {
+    kMalloc = 1,                // size
+    kMallocManaged,             // size; при воспроизведении финализатор пустой
+    kMallocWithParent,          // size, parent
+    kMallocWithParentManaged,   // size, parent
+    kMallocTyped,               // type
+    kRegisterType,              // type, size, count, offsets
+    kObject,                    // size; объект, созданный до начала записи
+    kStore,                     // parent, offset, value; нулевой номер — nullptr
+    kAddEdge,                   // parent, child
+    kDeleteEdge,                // parent, child
+    kSwapEdge,                  // parent, child1, child2
+    kAddEdges,                  // parent, count, children
+    kAddRoot,                   // ptr
+    kDeleteRoot,                // ptr
+    kAddRoots,                  // count, ptrs
+    kDeleteRoots,               // count, ptrs
+    kCollect,
+    kCollectMinor,
+    kObjectManaged,             // size; как kObject, но с финализатором
+    kObjectTyped,               // type; типизированный объект, созданный до начала записи
+    kPushHandle,                // ptr; хэндл gc::Root
+    kPopHandle,                 // ptr; снятый хэндл
+};
+
+constexpr char kTraceMagic[8] = {'G', 'C', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Пишет файл через отображение в память. Файл растёт кусками, при закрытии обрезается по данным
+class TraceWriter {
+    int fd_{-1};
+    char *data_{nullptr};
+    size_t size_{0};
+    size_t capacity_{0};
+
+    bool Grow(size_t need);
+public:
+    TraceWriter() = default;
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool Open(const std::string &path);
+    void Close();
+    void Write(const void *bytes, size_t count);
+    void WriteVarint(uint64_t value);
+};
+
+// Записывает операции сборщика. Указатели приходят уже приведёнными к началу объекта.
+// Между Start и Activate пишется снимок кучи, операции мутаторов в это время не записываются.
+// Объект, которого трасса всё же не видела, сначала объявляется событием kObject
+class TraceRecorder {
+public:
+    using SizeFn = std::function<size_t(const void *ptr)>;
+private:
+    std::atomic<bool> active_{false};
+    std::mutex mutex_;
+    // Файл открыт; active_ поднимается только после снимка
+    bool open_{false};
+    TraceWriter writer_;
+    std::unordered_map<const void*, uint64_t> ids_;
+    uint64_t next_id_{1};
+    uint64_t last_id_{0};
+    size_t events_{0};
+    SizeFn size_of_;
+
+    void Declare(const void *ptr);
+    void Begin(TraceOp op);
+    void WriteId(const void *ptr);
+    void NewObject(const void *ptr);
+public:
+    bool Active() const {
+        return active_.load(std::memory_order_relaxed);
+    }
+    // size_of сообщает размер объекта, созданного до начала записи
+    bool Start(const std::string &path, SizeFn size_of);
+    // Снимок записан, дальше пишутся операции мутаторов
+    void Activate();
+    // Возвращает число записанных событий
+    size_t Stop();
+
+    // Объект из снимка кучи; type — номер типа, 0 у нетипизированных
+    void Object(const void *ptr, size_t size, uint32_t type, bool managed);
+    void Malloc(const void *ptr, size_t size, bool managed, const void *parent);
+    void MallocTyped(const void *ptr, uint32_t type);
+    void RegisterType(uint32_t type, size_t size, const std::vector<uint32_t> &offsets);
+    void Store(const void *parent, size_t offset, const void *value);
+    void Edge(TraceOp op, const void *parent, const void *child);
+    void SwapEdge(const void *parent, const void *child1, const void *child2);
+    void AddEdges(const void *parent, void *const *children, size_t count);
+    void Root(TraceOp op, const void *ptr);
+    void Roots(TraceOp op, void *const *ptrs, size_t count);
+    void Collect(TraceOp op);
+};
+
+// Читает трассу из отображённого в память файла
+class TraceReader {
+    const uint8_t *data_{nullptr};
+    size_t size_{0};
+    size_t pos_{0};
+    bool failed_{false};
+    uint64_t next_id_{1};
+    uint64_t last_id_{0};
+public:
+    TraceReader() = default;
+    ~TraceReader();
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    // false, если файл не открылся или это не трасса
+    bool Open(const std::string &path);
+    // false в конце трассы
+    bool Next(TraceOp &op);
+    uint64_t ReadVarint();
+    uint64_t ReadId();
+    // Номер объекта, который создаёт текущее событие
+    uint64_t NewId();
+    // Трасса оборвалась посреди события
+    bool Failed() const {
+        return failed_;
+    }
+};
+
+// Воспроизводит трассу на вызывающем потоке через API сборщика, с полной скоростью.
+// Хэндлы держатся рёбрами от служебного корня. Возвращает число событий; SIZE_MAX, если файл
+// не трасса, повреждён или событие ссылается на неизвестный или уже освобождённый объект
+size_t ReplayTrace(const std::string &path);
+
+#endif
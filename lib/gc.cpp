@@ -1,49 +1,45 @@
 #include "gc_impl.h"
 
 void* gc_malloc(size_t size) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddAllocation(ptr, size);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().Allocate(size);
 }
 
 void* gc_malloc_manage(size_t size, FinalizerT finalizer) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddAllocation(ptr, size, finalizer);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().Allocate(size, finalizer);
 }
 
 void* gc_malloc_root(size_t size) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddRootAllocation(ptr, size);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().AllocateRoot(size);
 }
 void* gc_malloc_root_manage(size_t size, FinalizerT finalizer) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddRootAllocation(ptr, size, finalizer);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().AllocateRoot(size, finalizer);
 }
 
 void* gc_malloc_with_parent(size_t size, void *parent) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddAllocationWithParent(ptr, size, parent);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().AllocateWithParent(size, parent);
 }
 void* gc_malloc_with_parent_manage(size_t size, void *parent, FinalizerT finalizer) {
-    void *ptr = malloc(size);
-    if (ptr) {
-        GarbageCollector::GetInstance().AddAllocationWithParent(ptr, size, parent, finalizer);
-    }
-    return ptr;
+    return GarbageCollector::GetInstance().AllocateWithParent(size, parent, finalizer);
+}
+
+uint32_t gc_register_type(size_t size, const size_t *offsets, size_t count) {
+    return GarbageCollector::GetInstance().RegisterType(size, offsets, count);
+}
+
+void* gc_malloc_typed(uint32_t type) {
+    return GarbageCollector::GetInstance().AllocateTyped(type);
+}
+
+void gc_store(void *parent, void **field, void *value) {
+    GarbageCollector::GetInstance().StoreField(parent, field, value);
+}
+
+void gc_push_handle(void *ptr) {
+    GarbageCollector::GetInstance().PushHandle(ptr);
+}
+
+void gc_pop_handle() {
+    GarbageCollector::GetInstance().PopHandle();
 }
 
 void gc_add_edge(void *parent, void *child) {
@@ -66,6 +62,30 @@ void gc_delete_root(void *ptr) {
     GarbageCollector::GetInstance().DeleteRoot(ptr);
 }
 
+void gc_add_edges(void *parent, void *const *children, size_t count) {
+    GarbageCollector::GetInstance().AddEdges(parent, children, count);
+}
+
+void gc_add_edges_pairs(const GcEdge *edges, size_t count) {
+    GarbageCollector::GetInstance().AddEdgesPairs(edges, count);
+}
+
+void gc_add_roots(void *const *ptrs, size_t count) {
+    GarbageCollector::GetInstance().AddRoots(ptrs, count);
+}
+
+void gc_delete_roots(void *const *ptrs, size_t count) {
+    GarbageCollector::GetInstance().DeleteRoots(ptrs, count);
+}
+
+bool gc_register_thread() {
+    return GarbageCollector::GetInstance().RegisterThread();
+}
+
+void gc_unregister_thread() {
+    GarbageCollector::GetInstance().UnregisterThread();
+}
+
 void gc_block_collect() {
     GarbageCollector::GetInstance().BlockCollect();
 }
@@ -78,6 +98,78 @@ void gc_collect() {
     GarbageCollector::GetInstance().CollectGarbage();
 }
 
+size_t gc_compact() {
+    return GarbageCollector::GetInstance().Compact();
+}
+
+void gc_pin(void *ptr) {
+    GarbageCollector::GetInstance().Pin(ptr);
+}
+
+void gc_unpin(void *ptr) {
+    GarbageCollector::GetInstance().Unpin(ptr);
+}
+
+void gc_collect_minor() {
+    GarbageCollector::GetInstance().CollectMinor();
+}
+
+void gc_set_nursery_size(size_t bytes) {
+    GarbageCollector::GetInstance().SetNurserySize(bytes);
+}
+
+void gc_collect_concurrent() {
+    GarbageCollector::GetInstance().CollectConcurrent();
+}
+
+void gc_wait_for_collection() {
+    GarbageCollector::GetInstance().WaitForCollection();
+}
+
+void gc_get_last_pauses(GcPauseInfo *info) {
+    *info = GarbageCollector::GetInstance().LastPauses();
+}
+
+void gc_get_stats(GcStats *stats) {
+    *stats = GarbageCollector::GetInstance().Stats();
+}
+
+void gc_set_cycle_callback(GcCycleCallback callback, void *arg) {
+    GarbageCollector::GetInstance().SetCycleCallback(callback, arg);
+}
+
+bool gc_trace_start(const char *path) {
+    return GarbageCollector::GetInstance().StartTrace(path);
+}
+
+size_t gc_trace_stop() {
+    return GarbageCollector::GetInstance().StopTrace();
+}
+
+bool gc_dump_heap(const char *path) {
+    return GarbageCollector::GetInstance().DumpHeap(path);
+}
+
+void gc_set_mark_threads(size_t threads) {
+    GarbageCollector::GetInstance().SetMarkThreads(threads);
+}
+
+void gc_set_sweep_mode(GcSweepMode mode) {
+    GarbageCollector::GetInstance().SetSweepMode(mode);
+}
+
+size_t gc_run_finalizers(size_t max) {
+    return GarbageCollector::GetInstance().RunFinalizers(max);
+}
+
+void gc_start_finalizer_thread() {
+    GarbageCollector::GetInstance().StartFinalizerThread();
+}
+
+void gc_stop_finalizer_thread() {
+    GarbageCollector::GetInstance().StopFinalizerThread();
+}
+
 
 void gc_start_incremental_mark() {
     GarbageCollector::GetInstance().StartIncrementalMark();
@@ -87,6 +179,14 @@ void gc_step_mark() {
     GarbageCollector::GetInstance().StepMark();
 }
 
+bool gc_step_mark_for(uint64_t budget_ns) {
+    return GarbageCollector::GetInstance().StepMarkFor(budget_ns);
+}
+
+bool gc_step_mark_work(size_t edges) {
+    return GarbageCollector::GetInstance().StepMarkWork(edges);
+}
+
 bool gc_is_marking() {
     return GarbageCollector::GetInstance().IsMarking();
 }
@@ -95,6 +195,18 @@ void gc_finish_incremental_mark() {
     GarbageCollector::GetInstance().FinishIncrementalMark();
 }
 
+void gc_set_gc_percent(int percent) {
+    GarbageCollector::GetInstance().SetGcPercent(percent);
+}
+
+void gc_set_scavenge_delay(int delay_ms) {
+    GarbageCollector::GetInstance().SetScavengeDelay(delay_ms);
+}
+
+size_t gc_release_memory() {
+    return GarbageCollector::GetInstance().ReleaseMemory();
+}
+
 void gc_start_background_collector(size_t steps, int interval_ms) {
     GarbageCollector::GetInstance().StartBackgroundCollector(steps, interval_ms);
 }
@@ -0,0 +1,204 @@
+#include "gc_edges.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+EdgeList::~EdgeList() {
+    Clear();
+}
+
+uint32_t EdgeList::Find(const void *child) {
+    void **children = Children();
+    if (IsInline()) {
+        for (uint32_t i = 0; i < size_; ++i) {
+            if (children[i] == child) return i;
+        }
+        return size_;
+    }
+    void **it = std::lower_bound(children, children + size_, child);
+    return it != children + size_ && *it == child ? it - children : size_;
+}
+
+void EdgeList::Grow() {
+    uint32_t capacity = capacity_ * 2;
+    auto **children = static_cast<void**>(malloc(capacity * (sizeof(void*) + sizeof(uint32_t))));
+    auto *counts = reinterpret_cast<uint32_t*>(children + capacity);
+    memcpy(children, Children(), size_ * sizeof(void*));
+    memcpy(counts, Counts(), size_ * sizeof(uint32_t));
+
+    if (IsInline()) {
+        // Встроенная часть не упорядочена, при переезде в кучу сортируем вместе со счётчиками
+        for (uint32_t i = 1; i < size_; ++i) {
+            for (uint32_t j = i; j > 0 && children[j - 1] > children[j]; --j) {
+                std::swap(children[j - 1], children[j]);
+                std::swap(counts[j - 1], counts[j]);
+            }
+        }
+    } else {
+        free(heap_.children_);
+    }
+    heap_.children_ = children;
+    heap_.counts_ = counts;
+    capacity_ = capacity;
+}
+
+void EdgeList::SortByAddress() {
+    void **children = Children();
+    uint32_t *counts = Counts();
+    std::vector<std::pair<void*, uint32_t>> edges(size_);
+    for (uint32_t i = 0; i < size_; ++i) {
+        edges[i] = {children[i], counts[i]};
+    }
+    std::sort(edges.begin(), edges.end());
+    for (uint32_t i = 0; i < size_; ++i) {
+        children[i] = edges[i].first;
+        counts[i] = edges[i].second;
+    }
+}
+
+void EdgeList::Add(void *child) {
+    uint32_t index = Find(child);
+    if (index != size_) {
+        ++Counts()[index];
+        return;
+    }
+
+    if (size_ == capacity_) {
+        Grow();
+    }
+    void **children = Children();
+    uint32_t *counts = Counts();
+    if (IsInline()) {
+        index = size_;
+    } else {
+        index = std::lower_bound(children, children + size_, child) - children;
+        memmove(children + index + 1, children + index, (size_ - index) * sizeof(void*));
+        memmove(counts + index + 1, counts + index, (size_ - index) * sizeof(uint32_t));
+    }
+    children[index] = child;
+    counts[index] = 1;
+    ++size_;
+}
+
+void EdgeList::AddMany(void *const *children, size_t count) {
+    if (count < kBulkThreshold) {
+        for (size_t i = 0; i < count; ++i) {
+            Add(children[i]);
+        }
+        return;
+    }
+
+    std::vector<void*> added(children, children + count);
+    std::sort(added.begin(), added.end());
+
+    // Встроенная часть не упорядочена, её сортируем вместе со счётчиками
+    void **old_children = Children();
+    uint32_t *old_counts = Counts();
+    std::vector<std::pair<void*, uint32_t>> inline_edges;
+    if (IsInline()) {
+        for (uint32_t i = 0; i < size_; ++i) {
+            inline_edges.emplace_back(old_children[i], old_counts[i]);
+        }
+        std::sort(inline_edges.begin(), inline_edges.end());
+        for (uint32_t i = 0; i < size_; ++i) {
+            old_children[i] = inline_edges[i].first;
+            old_counts[i] = inline_edges[i].second;
+        }
+    }
+
+    uint32_t capacity = capacity_;
+    while (capacity < size_ + count) {
+        capacity *= 2;
+    }
+    auto **merged = static_cast<void**>(malloc(capacity * (sizeof(void*) + sizeof(uint32_t))));
+    auto *merged_counts = reinterpret_cast<uint32_t*>(merged + capacity);
+
+    uint32_t size = 0;
+    uint32_t i = 0;
+    size_t j = 0;
+    while (i < size_ || j < count) {
+        void *child;
+        uint32_t child_count = 0;
+        if (j == count || (i < size_ && old_children[i] <= added[j])) {
+            child = old_children[i];
+            child_count = old_counts[i++];
+        } else {
+            child = added[j];
+        }
+        while (j < count && added[j] == child) {
+            ++child_count;
+            ++j;
+        }
+        merged[size] = child;
+        merged_counts[size] = child_count;
+        ++size;
+    }
+
+    if (!IsInline()) {
+        free(heap_.children_);
+    }
+    heap_.children_ = merged;
+    heap_.counts_ = merged_counts;
+    capacity_ = capacity;
+    size_ = size;
+}
+
+bool EdgeList::Remove(void *child) {
+    uint32_t index = Find(child);
+    if (index == size_) return false;
+
+    uint32_t *counts = Counts();
+    if (--counts[index] > 0) return true;
+
+    void **children = Children();
+    --size_;
+    if (IsInline()) {
+        children[index] = children[size_];
+        counts[index] = counts[size_];
+    } else {
+        memmove(children + index, children + index + 1, (size_ - index) * sizeof(void*));
+        memmove(counts + index, counts + index + 1, (size_ - index) * sizeof(uint32_t));
+    }
+    return true;
+}
+
+void EdgeList::Clear() {
+    if (!IsInline()) {
+        free(heap_.children_);
+        capacity_ = kInlineEdges;
+    }
+    size_ = 0;
+}
+
+EdgeTable::~EdgeTable() {
+    for (auto &chunk : chunks_) {
+        delete[] chunk.load();
+    }
+}
+
+uint32_t EdgeTable::Create() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!free_handles_.empty()) {
+        uint32_t handle = free_handles_.back();
+        free_handles_.pop_back();
+        return handle;
+    }
+
+    // Дескрипторы кончились: как и при нехватке памяти под чанк, сообщаем исключением, а не пишем за массив
+    if (next_handle_ >= kMaxChunks * kChunkSize) {
+        throw std::bad_alloc();
+    }
+    uint32_t handle = next_handle_++;
+    auto &chunk = chunks_[handle >> kChunkBits];
+    if (!chunk.load(std::memory_order_relaxed)) {
+        chunk.store(new EdgeList[kChunkSize], std::memory_order_release);
+    }
+    return handle;
+}
+
+void EdgeTable::Release(uint32_t handle) {
+    Get(handle).Clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_handles_.push_back(handle);
+}
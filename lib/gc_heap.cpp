@@ -0,0 +1,882 @@
+#include "gc_heap.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+
+namespace {
+
+void* MapAligned(size_t size) {
+    size_t mapped = size + kPageSize;
+    void *raw = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+
+    uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = (begin + kPageSize - 1) & ~(kPageSize - 1);
+    if (aligned != begin) {
+        munmap(raw, aligned - begin);
+    }
+    uintptr_t tail = begin + mapped - (aligned + size);
+    if (tail) {
+        munmap(reinterpret_cast<void*>(aligned + size), tail);
+    }
+    return reinterpret_cast<void*>(aligned);
+}
+
+// Занятые, не отмеченные и не ждущие финализации слоты
+uint64_t DeadBits(const Span *span, uint32_t w) {
+    return span->alloc_bits_[w].load(std::memory_order_relaxed) &
+           ~span->mark_bits_[w].load(std::memory_order_relaxed) &
+           ~span->finalizing_bits_[w].load(std::memory_order_relaxed);
+}
+
+}
+
+size_t SizeClassOf(size_t size) {
+    if (size <= 128) {
+        return size <= 16 ? 1 : (size + 15) >> 4;
+    }
+    // Начиная со 128 байт на каждый отрезок (2^k, 2^(k+1)] приходится 4 класса
+    size_t k = 63 - __builtin_clzll(size - 1);
+    size_t index = (size - 1 - (size_t{1} << k)) >> (k - 2);
+    return 9 + (k - 7) * 4 + index;
+}
+
+size_t SizeClassSize(size_t size_class) {
+    if (size_class <= 8) {
+        return size_class * 16;
+    }
+    size_t k = 7 + (size_class - 9) / 4;
+    size_t index = (size_class - 9) % 4;
+    return (size_t{1} << k) + (index + 1) * (size_t{1} << (k - 2));
+}
+
+void PageMap::Set(const void *start, size_t pages, Span *span) {
+    uintptr_t page = reinterpret_cast<uintptr_t>(start) >> kPageShift;
+    for (size_t i = 0; i < pages; ++i, ++page) {
+        auto &slot = root_[page >> kLeafBits];
+        Leaf *leaf = slot.load(std::memory_order_acquire);
+        if (!leaf) {
+            // mmap отдаёт обнулённую память, поэтому лист не нужно инициализировать
+            leaf = static_cast<Leaf*>(mmap(nullptr, sizeof(Leaf), PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            slot.store(leaf, std::memory_order_release);
+        }
+        leaf->spans_[page & ((size_t{1} << kLeafBits) - 1)].store(span, std::memory_order_release);
+    }
+}
+
+void SpanList::Push(Span *span) {
+    span->prev_ = nullptr;
+    span->next_ = head_;
+    span->list_ = this;
+    if (head_) {
+        head_->prev_ = span;
+    } else {
+        tail_ = span;
+    }
+    head_ = span;
+    ++size_;
+}
+
+void SpanList::Remove(Span *span) {
+    if (span->prev_) {
+        span->prev_->next_ = span->next_;
+    } else {
+        head_ = span->next_;
+    }
+    if (span->next_) {
+        span->next_->prev_ = span->prev_;
+    } else {
+        tail_ = span->prev_;
+    }
+    span->next_ = span->prev_ = nullptr;
+    span->list_ = nullptr;
+    --size_;
+}
+
+void SpanList::Splice(SpanList &other) {
+    if (!other.head_) return;
+    if (tail_) {
+        tail_->next_ = other.head_;
+        other.head_->prev_ = tail_;
+    } else {
+        head_ = other.head_;
+    }
+    tail_ = other.tail_;
+    size_ += other.size_;
+    other.head_ = other.tail_ = nullptr;
+    other.size_ = 0;
+}
+
+void Heap::GrowArena() {
+    char *arena = static_cast<char*>(MapAligned(kArenaPages * kPageSize));
+    if (!arena) return;
+
+    for (size_t i = 0; i < kArenaPages; ++i) {
+        Span *span = new Span;
+        span->start_ = arena + i * kPageSize;
+        span->pages_ = 1;
+        // Свежие страницы mmap ещё не занимают физической памяти
+        released_pages_.Push(span);
+    }
+}
+
+// Сначала берём страницы, которые ещё в памяти: они тёплые и не требуют от ядра новых
+Span* Heap::AllocateSpan(size_t size_class) {
+    Span *span = free_pages_.head_;
+    if (span) {
+        free_pages_.Remove(span);
+        idle_bytes_.fetch_sub(span->pages_ * kPageSize, std::memory_order_relaxed);
+    } else {
+        if (!released_pages_.head_) {
+            GrowArena();
+            if (!released_pages_.head_) return nullptr;
+        }
+        span = released_pages_.head_;
+        released_pages_.Remove(span);
+    }
+
+    span->size_class_ = size_class;
+    span->slot_size_ = SizeClassSize(size_class);
+    span->slot_count_ = kPageSize / span->slot_size_;
+    span->div_magic_ = ((uint64_t{1} << 32) + span->slot_size_ - 1) / span->slot_size_;
+    span->live_count_ = 0;
+    span->fresh_index_ = 0;
+    span->free_list_ = nullptr;
+    span->swept_epoch_.store(sweep_epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    InitBitmaps(span);
+    page_map_.Set(span->start_, 1, span);
+    partial_[size_class].Push(span);
+    return span;
+}
+
+void Heap::ReleaseSpan(Span *span) {
+    page_map_.Set(span->start_, 1, nullptr);
+    span->idle_since_ = std::chrono::steady_clock::now();
+    free_pages_.Push(span);
+    idle_bytes_.fetch_add(span->pages_ * kPageSize, std::memory_order_relaxed);
+}
+
+// Страницы спана уже отданы системе, при повторном использовании ядро выдаст обнулённую память
+void Heap::ReleasedSpanLocked(Span *span) {
+    page_map_.Set(span->start_, 1, nullptr);
+    released_pages_.Push(span);
+}
+
+void* Heap::AllocateLarge(size_t size, uint16_t finalizer, uint16_t type) {
+    size_t pages = (size + kPageSize - 1) >> kPageShift;
+    char *start = static_cast<char*>(MapAligned(pages * kPageSize));
+    if (!start) return nullptr;
+
+    Span *span = new Span;
+    span->start_ = start;
+    span->pages_ = pages;
+    span->large_size_ = size;
+    span->slot_size_ = pages * kPageSize;
+    span->slot_count_ = 1;
+    span->live_count_ = 1;
+    span->fresh_index_ = 1;
+    InitBitmaps(span);
+    span->meta_[0] = {0, 0, finalizer, type, 0};
+    span->young_bits_[0].store(1, std::memory_order_relaxed);
+    span->alloc_bits_[0].store(1, std::memory_order_relaxed);
+    allocated_bytes_.fetch_add(size, std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    span->swept_epoch_.store(sweep_epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    if (allocate_black_.load(std::memory_order_relaxed)) {
+        span->mark_bits_[0].store(1, std::memory_order_relaxed);
+    }
+    // Прежде чем занимать новую память, освобождаем мёртвые большие объекты прошлого цикла
+    while (Span *unswept = unswept_large_.head_) {
+        unswept_large_.Remove(unswept);
+        unswept_count_.fetch_sub(1, std::memory_order_relaxed);
+        SweepSpanLocked(unswept, true);
+    }
+    page_map_.Set(start, pages, span);
+    large_.Push(span);
+    return start;
+}
+
+void Heap::FreeLarge(Span *span) {
+    page_map_.Set(span->start_, span->pages_, nullptr);
+    munmap(span->start_, span->pages_ * kPageSize);
+    FreeBitmaps(span);
+    delete span;
+}
+
+Span* Heap::PartialSpanLocked(size_t size_class) {
+    Span *span = partial_[size_class].head_;
+    // Ленивое подметание: свободные слоты сначала ищем в неподметённых спанах этого класса
+    while (!span && unswept_[size_class].head_) {
+        Span *unswept = unswept_[size_class].head_;
+        unswept_[size_class].Remove(unswept);
+        unswept_count_.fetch_sub(1, std::memory_order_relaxed);
+        SweepSpanLocked(unswept, true);
+        span = partial_[size_class].head_;
+    }
+    return span ? span : AllocateSpan(size_class);
+}
+
+// Резервирует для потока слоты одного спана; спан остаётся в своём списке
+void Heap::RefillLocked(ThreadCache::Bin &bin, size_t size_class, size_t want) {
+    Span *span = PartialSpanLocked(size_class);
+    if (!span) return;
+
+    want = std::max<size_t>(want, 1);
+    size_t taken = 0;
+    FreeSlot **tail = &bin.head_;
+    for (; taken < want && span->live_count_ < span->slot_count_; ++taken) {
+        FreeSlot *slot;
+        if (span->free_list_) {
+            slot = span->free_list_;
+            span->free_list_ = slot->next_;
+        } else {
+            slot = static_cast<FreeSlot*>(span->SlotAddress(span->fresh_index_++));
+        }
+        *tail = slot;
+        tail = &slot->next_;
+        ++span->live_count_;
+    }
+    *tail = nullptr;
+    bin.span_ = span;
+    allocated_bytes_.fetch_add(taken * span->slot_size_, std::memory_order_relaxed);
+
+    if (span->live_count_ == span->slot_count_) {
+        partial_[size_class].Remove(span);
+        full_[size_class].Push(span);
+    }
+}
+
+void Heap::FlushLocked(ThreadCache &cache) {
+    for (auto &bin : cache.bins_) {
+        if (!bin.head_) continue;
+        while (FreeSlot *slot = bin.head_) {
+            bin.head_ = slot->next_;
+            FreeLocked(bin.span_, bin.span_->SlotIndex(slot));
+        }
+        RefileLocked(bin.span_);
+        bin.span_ = nullptr;
+    }
+}
+
+namespace {
+
+struct LocalCacheHolder {
+    Heap *heap_{nullptr};
+    ThreadCache *cache_{nullptr};
+
+    ~LocalCacheHolder() {
+        if (cache_) {
+            heap_->DetachCache(cache_);
+        }
+    }
+};
+
+thread_local LocalCacheHolder local_cache;
+
+}
+
+ThreadCache* Heap::LocalCache() {
+    if (local_cache.heap_ == this) return local_cache.cache_;
+    if (local_cache.heap_) return nullptr;
+
+    auto *cache = new ThreadCache;
+    {
+        std::unique_lock<std::mutex> lock(caches_mutex_);
+        cache->next_ = caches_;
+        if (caches_) {
+            caches_->prev_ = cache;
+        }
+        caches_ = cache;
+    }
+    local_cache.heap_ = this;
+    local_cache.cache_ = cache;
+    return cache;
+}
+
+void Heap::DetachCache(ThreadCache *cache) {
+    std::unique_lock<std::mutex> caches_lock(caches_mutex_);
+    {
+        std::lock_guard<SpinLock> cache_lock(cache->lock_);
+        std::unique_lock<std::mutex> lock(mutex_);
+        FlushLocked(*cache);
+    }
+    if (cache->prev_) {
+        cache->prev_->next_ = cache->next_;
+    } else {
+        caches_ = cache->next_;
+    }
+    if (cache->next_) {
+        cache->next_->prev_ = cache->prev_;
+    }
+    delete cache;
+}
+
+void* Heap::InitSlot(Span *span, void *ptr, size_t size, uint16_t finalizer, uint16_t type) {
+    uint32_t index = span->SlotIndex(ptr);
+    span->meta_[index] = {static_cast<uint32_t>(size), 0, finalizer, type, 0};
+    uint64_t bit = uint64_t{1} << (index % 64);
+    span->young_bits_[index / 64].fetch_or(bit, std::memory_order_relaxed);
+    if (allocate_black_.load(std::memory_order_relaxed)) {
+        span->mark_bits_[index / 64].fetch_or(bit, std::memory_order_relaxed);
+    }
+    span->alloc_bits_[index / 64].fetch_or(bit, std::memory_order_relaxed);
+    return ptr;
+}
+
+void* Heap::Allocate(size_t size, uint16_t finalizer, uint16_t type) {
+    if (size > kMaxSmallSize) {
+        return AllocateLarge(size, finalizer, type);
+    }
+
+    size_t size_class = SizeClassOf(size);
+    ThreadCache *cache = LocalCache();
+    if (!cache) {
+        // Поток уже работает с другой кучей — кэш ему не заводим, берём один слот под блокировкой
+        ThreadCache::Bin bin;
+        std::unique_lock<std::mutex> lock(mutex_);
+        RefillLocked(bin, size_class, 1);
+        return bin.head_ ? InitSlot(bin.span_, bin.head_, size, finalizer, type) : nullptr;
+    }
+
+    std::lock_guard<SpinLock> cache_lock(cache->lock_);
+    ThreadCache::Bin &bin = cache->bins_[size_class];
+    if (!bin.head_) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        RefillLocked(bin, size_class, kThreadCacheBytes / SizeClassSize(size_class));
+        if (!bin.head_) return nullptr;
+    }
+    FreeSlot *slot = bin.head_;
+    bin.head_ = slot->next_;
+    return InitSlot(bin.span_, slot, size, finalizer, type);
+}
+
+void Heap::InitBitmaps(Span *span) {
+    uint32_t words = span->BitmapWords();
+    if (span->meta_capacity_ < span->slot_count_) {
+        FreeBitmaps(span);
+        span->meta_ = new ObjectMeta[span->slot_count_];
+        span->alloc_bits_ = new std::atomic<uint64_t>[words];
+        span->mark_bits_ = new std::atomic<uint64_t>[words];
+        span->finalizing_bits_ = new std::atomic<uint64_t>[words];
+        span->young_bits_ = new std::atomic<uint64_t>[words];
+        span->remembered_bits_ = new std::atomic<uint64_t>[words];
+        span->meta_capacity_ = span->slot_count_;
+    }
+    for (uint32_t w = 0; w < words; ++w) {
+        span->alloc_bits_[w].store(0, std::memory_order_relaxed);
+        span->mark_bits_[w].store(0, std::memory_order_relaxed);
+        span->finalizing_bits_[w].store(0, std::memory_order_relaxed);
+        span->young_bits_[w].store(0, std::memory_order_relaxed);
+        span->remembered_bits_[w].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Heap::FreeBitmaps(Span *span) {
+    delete[] span->meta_;
+    delete[] span->alloc_bits_;
+    delete[] span->mark_bits_;
+    delete[] span->finalizing_bits_;
+    delete[] span->young_bits_;
+    delete[] span->remembered_bits_;
+}
+
+void Heap::FreeLocked(Span *span, uint32_t index) {
+    uint64_t clear = ~(uint64_t{1} << (index % 64));
+    span->alloc_bits_[index / 64].fetch_and(clear, std::memory_order_relaxed);
+    span->young_bits_[index / 64].fetch_and(clear, std::memory_order_relaxed);
+    span->remembered_bits_[index / 64].fetch_and(clear, std::memory_order_relaxed);
+    auto *slot = static_cast<FreeSlot*>(span->SlotAddress(index));
+    slot->next_ = span->free_list_;
+    span->free_list_ = slot;
+    --span->live_count_;
+}
+
+// true, если слот можно освобождать сразу; иначе он помечается как ждущий финализации
+bool Heap::ReleaseDead(Span *span, uint32_t index) {
+    if (!on_dead_ || on_dead_(span, index)) return true;
+    span->finalizing_bits_[index / 64].fetch_or(uint64_t{1} << (index % 64), std::memory_order_relaxed);
+    return false;
+}
+
+// Счётчики общие для всех подметающих потоков, поэтому обновляются раз на спан, а не на объект
+void Heap::CountSwept(uint64_t objects, uint64_t bytes, std::chrono::steady_clock::time_point started) {
+    if (objects) {
+        objects_freed_.fetch_add(objects, std::memory_order_relaxed);
+        bytes_freed_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    sweep_ns_.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count(),
+        std::memory_order_relaxed);
+}
+
+// Спан к этому моменту не входит ни в один список; после подметания он попадает в подходящий
+void Heap::SweepSpanLocked(Span *span, bool run_hooks) {
+    auto started = std::chrono::steady_clock::now();
+    uint64_t freed = 0;
+    uint64_t freed_bytes = 0;
+    bool large = span->size_class_ == kLargeSizeClass;
+    for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+        uint64_t dead = DeadBits(span, w);
+        span->mark_bits_[w].store(0, std::memory_order_relaxed);
+        // Выжившие повышены полной сборкой
+        span->young_bits_[w].store(0, std::memory_order_relaxed);
+        for (; dead; dead &= dead - 1) {
+            uint32_t index = w * 64 + __builtin_ctzll(dead);
+            if (run_hooks && !ReleaseDead(span, index)) {
+                continue;
+            }
+            ++freed;
+            freed_bytes += span->ObjectSize(index);
+            if (large) {
+                FreeLarge(span);
+                CountSwept(freed, freed_bytes, started);
+                return;
+            }
+            FreeLocked(span, index);
+        }
+    }
+    CountSwept(freed, freed_bytes, started);
+    // Публикуется после снятия молодых битов: барьер, увидевший подметённый спан, видит и их
+    span->swept_epoch_.store(sweep_epoch_.load(std::memory_order_relaxed), std::memory_order_release);
+
+    if (large) {
+        large_.Push(span);
+    } else if (span->live_count_ == 0) {
+        ReleaseSpan(span);
+    } else if (span->live_count_ == span->slot_count_) {
+        full_[span->size_class_].Push(span);
+    } else {
+        partial_[span->size_class_].Push(span);
+    }
+}
+
+Span* Heap::TakeUnsweptLocked() {
+    SpanList *list = unswept_large_.head_ ? &unswept_large_ : nullptr;
+    for (size_t i = 1; !list && i < kNumSizeClasses; ++i) {
+        if (unswept_[i].head_) list = &unswept_[i];
+    }
+    if (!list) return nullptr;
+
+    Span *span = list->head_;
+    list->Remove(span);
+    return span;
+}
+
+bool Heap::SweepOneLocked() {
+    Span *span = TakeUnsweptLocked();
+    if (!span) return false;
+    unswept_count_.fetch_sub(1, std::memory_order_relaxed);
+    SweepSpanLocked(span, true);
+    return true;
+}
+
+bool Heap::SweepOneConcurrent() {
+    Span *span;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        span = TakeUnsweptLocked();
+        if (!span) return false;
+        sweeping_.Push(span);
+    }
+
+    // Спан вне списков аллокатора, новая маркировка не начнётся, пока он не подметён,
+    // а FreeFinalized его дожидается, так что до повторного захвата блокировки меняются
+    // только биты финализации, которые ставит сам ReleaseDead
+    auto started = std::chrono::steady_clock::now();
+    for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+        for (uint64_t dead = DeadBits(span, w); dead; dead &= dead - 1) {
+            ReleaseDead(span, w * 64 + __builtin_ctzll(dead));
+        }
+    }
+    CountSwept(0, 0, started);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        sweeping_.Remove(span);
+        SweepSpanLocked(span, false);
+        unswept_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    sweeping_cv_.notify_all();
+    return true;
+}
+
+void Heap::FreeFinalized(Span *span, uint32_t index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sweeping_cv_.wait(lock, [this, span] { return span->list_ != &sweeping_; });
+    span->finalizing_bits_[index / 64].fetch_and(~(uint64_t{1} << (index % 64)), std::memory_order_relaxed);
+    objects_freed_.fetch_add(1, std::memory_order_relaxed);
+    bytes_freed_.fetch_add(span->ObjectSize(index), std::memory_order_relaxed);
+
+    if (span->size_class_ == kLargeSizeClass) {
+        if (IsSwept(span)) {
+            large_.Remove(span);
+        } else {
+            unswept_large_.Remove(span);
+            unswept_count_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        FreeLarge(span);
+        return;
+    }
+
+    FreeLocked(span, index);
+    RefileLocked(span);
+}
+
+// Неподметённый спан разложит по спискам подметание, подметённый перекладываем сами
+void Heap::RefileLocked(Span *span) {
+    SpanList *list = span->list_;
+    size_t size_class = span->size_class_;
+    if (!IsSwept(span) || (list != &partial_[size_class] && list != &full_[size_class])) return;
+
+    list->Remove(span);
+    if (span->live_count_ == 0) {
+        ReleaseSpan(span);
+    } else if (span->live_count_ == span->slot_count_) {
+        full_[size_class].Push(span);
+    } else {
+        partial_[size_class].Push(span);
+    }
+}
+
+void Heap::LockCaches() {
+    caches_mutex_.lock();
+    for (ThreadCache *cache = caches_; cache; cache = cache->next_) {
+        cache->lock_.lock();
+    }
+}
+
+void Heap::UnlockCaches() {
+    for (ThreadCache *cache = caches_; cache; cache = cache->next_) {
+        cache->lock_.unlock();
+    }
+    caches_mutex_.unlock();
+}
+
+void Heap::StartAllocatingBlack() {
+    LockCaches();
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        allocate_black_.store(true, std::memory_order_relaxed);
+    }
+    UnlockCaches();
+}
+
+std::vector<void*> Heap::SweepYoung(uint8_t promote_age) {
+    std::vector<void*> promoted;
+    LockCaches();
+    std::unique_lock<std::mutex> lock(mutex_);
+    allocate_black_.store(false, std::memory_order_relaxed);
+    auto started = std::chrono::steady_clock::now();
+    uint64_t freed_objects = 0;
+    uint64_t freed_bytes = 0;
+
+    // Подметание перекладывает спаны между списками, поэтому сначала собираем их
+    std::vector<Span*> spans;
+    auto collect = [&spans](const SpanList &list) {
+        for (Span *span = list.head_; span; span = span->next_) {
+            spans.push_back(span);
+        }
+    };
+    for (size_t i = 1; i < kNumSizeClasses; ++i) {
+        collect(partial_[i]);
+        collect(full_[i]);
+    }
+    collect(large_);
+
+    for (Span *span : spans) {
+        bool large = span->size_class_ == kLargeSizeClass;
+        bool freed = false;
+        for (uint32_t w = 0, words = span->BitmapWords(); w < words && !freed; ++w) {
+            uint64_t young = span->young_bits_[w].load(std::memory_order_relaxed) &
+                             span->alloc_bits_[w].load(std::memory_order_relaxed);
+            // Метки ставились и старым объектам — барьером и при обходе запомненного множества
+            uint64_t marked = span->mark_bits_[w].exchange(0, std::memory_order_relaxed);
+            if (!young) continue;
+
+            for (uint64_t live = young & marked; live; live &= live - 1) {
+                uint32_t index = w * 64 + __builtin_ctzll(live);
+                if (++span->meta_[index].age_ >= promote_age) {
+                    span->young_bits_[w].fetch_and(~(uint64_t{1} << (index % 64)), std::memory_order_relaxed);
+                    promoted.push_back(span->SlotAddress(index));
+                }
+            }
+            uint64_t dead = young & ~marked & ~span->finalizing_bits_[w].load(std::memory_order_relaxed);
+            for (; dead; dead &= dead - 1) {
+                uint32_t index = w * 64 + __builtin_ctzll(dead);
+                if (!ReleaseDead(span, index)) continue;
+                ++freed_objects;
+                freed_bytes += span->ObjectSize(index);
+                if (large) {
+                    large_.Remove(span);
+                    FreeLarge(span);
+                    freed = true;
+                    break;
+                }
+                FreeLocked(span, index);
+            }
+        }
+        if (!large) {
+            RefileLocked(span);
+        }
+    }
+    CountSwept(freed_objects, freed_bytes, started);
+
+    lock.unlock();
+    UnlockCaches();
+    return promoted;
+}
+
+void Heap::StartSweep() {
+    // Слоты, зарезервированные потоками в спанах прошлого цикла, возвращаем: иначе объект,
+    // выделенный из них уже без метки, подметание сочло бы мёртвым.
+    // Кэши остаются захваченными, пока спаны не переложены в неподметённые
+    LockCaches();
+    std::unique_lock<std::mutex> lock(mutex_);
+    allocate_black_.store(false, std::memory_order_relaxed);
+    for (ThreadCache *cache = caches_; cache; cache = cache->next_) {
+        FlushLocked(*cache);
+    }
+
+    size_t count = large_.size_;
+    for (size_t i = 1; i < kNumSizeClasses; ++i) {
+        count += partial_[i].size_ + full_[i].size_;
+        unswept_[i].Splice(partial_[i]);
+        unswept_[i].Splice(full_[i]);
+    }
+    unswept_large_.Splice(large_);
+    sweep_epoch_.fetch_add(1, std::memory_order_relaxed);
+    unswept_count_.fetch_add(count, std::memory_order_relaxed);
+
+    lock.unlock();
+    UnlockCaches();
+}
+
+bool Heap::SweepSome(size_t max_spans) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t swept = 0;
+    while (swept < max_spans && SweepOneLocked()) {
+        ++swept;
+    }
+    return swept > 0;
+}
+
+void Heap::FinishSweep() {
+    if (!HasUnswept()) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (SweepOneLocked()) {
+    }
+    sweeping_cv_.wait(lock, [this] { return !sweeping_.head_; });
+}
+
+size_t Heap::ObjectCount() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t count = 0;
+    // live_count_ включает слоты, зарезервированные кэшами потоков, поэтому считаем по битам занятости
+    auto count_live = [&count](const SpanList &list) {
+        for (Span *span = list.head_; span; span = span->next_) {
+            for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+                count += __builtin_popcountll(span->alloc_bits_[w].load(std::memory_order_relaxed));
+            }
+        }
+    };
+    auto count_marked = [&count](const SpanList &list) {
+        for (Span *span = list.head_; span; span = span->next_) {
+            for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+                count += __builtin_popcountll(span->alloc_bits_[w].load(std::memory_order_relaxed) &
+                                              ~DeadBits(span, w));
+            }
+        }
+    };
+    for (size_t i = 1; i < kNumSizeClasses; ++i) {
+        count_live(partial_[i]);
+        count_live(full_[i]);
+        count_marked(unswept_[i]);
+    }
+    count_live(large_);
+    count_marked(unswept_large_);
+    count_marked(sweeping_);
+    return count;
+}
+
+// Слот под переносимый объект. Ленивого подметания здесь нет: к уплотнению куча подметена
+void* Heap::TakeSlotLocked(size_t size_class) {
+    Span *span = partial_[size_class].head_;
+    if (!span) {
+        span = AllocateSpan(size_class);
+        if (!span) return nullptr;
+    }
+
+    void *slot;
+    if (span->free_list_) {
+        slot = span->free_list_;
+        span->free_list_ = span->free_list_->next_;
+    } else {
+        slot = span->SlotAddress(span->fresh_index_++);
+    }
+    if (++span->live_count_ == span->slot_count_) {
+        partial_[size_class].Remove(span);
+        full_[size_class].Push(span);
+    }
+    return slot;
+}
+
+// Спан уже в evacuated_. Объект переезжает вместе с метаданными, поэтому хук мёртвых объектов
+// для старого слота не вызывается
+void Heap::EvacuateSpanLocked(Span *span) {
+    span->forward_ = new void*[span->slot_count_]();
+    for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+        for (uint64_t live = span->alloc_bits_[w].load(std::memory_order_relaxed); live; live &= live - 1) {
+            uint32_t index = w * 64 + __builtin_ctzll(live);
+            void *to = TakeSlotLocked(span->size_class_);
+            if (!to) return;
+
+            Span *to_span = page_map_.Get(to);
+            uint32_t to_index = to_span->SlotIndex(to);
+            uint64_t bit = uint64_t{1} << (to_index % 64);
+            memcpy(to, span->SlotAddress(index), span->slot_size_);
+            to_span->meta_[to_index] = span->meta_[index];
+            if (span->IsYoung(index)) {
+                to_span->young_bits_[to_index / 64].fetch_or(bit, std::memory_order_relaxed);
+            }
+            if (span->IsRemembered(index)) {
+                to_span->remembered_bits_[to_index / 64].fetch_or(bit, std::memory_order_relaxed);
+            }
+            to_span->alloc_bits_[to_index / 64].fetch_or(bit, std::memory_order_relaxed);
+
+            span->forward_[index] = to;
+            FreeLocked(span, index);
+        }
+    }
+}
+
+size_t Heap::Evacuate(size_t max_occupancy_percent, const std::function<bool(void*)> &pinned) {
+    LockCaches();
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Зарезервированные кэшами слоты иначе считались бы занятыми
+    for (ThreadCache *cache = caches_; cache; cache = cache->next_) {
+        FlushLocked(*cache);
+    }
+
+    auto movable = [&pinned](Span *span) {
+        for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+            if (span->finalizing_bits_[w].load(std::memory_order_relaxed)) return false;
+            for (uint64_t live = span->alloc_bits_[w].load(std::memory_order_relaxed); live; live &= live - 1) {
+                if (pinned(span->SlotAddress(w * 64 + __builtin_ctzll(live)))) return false;
+            }
+        }
+        return true;
+    };
+
+    size_t evacuated = 0;
+    for (size_t size_class = 1; size_class < kNumSizeClasses && !HasUnswept(); ++size_class) {
+        std::vector<Span*> candidates;
+        size_t moving = 0;
+        size_t room = 0;
+        for (Span *span = partial_[size_class].head_; span; span = span->next_) {
+            if (span->live_count_ * 100 <= span->slot_count_ * max_occupancy_percent && movable(span)) {
+                candidates.push_back(span);
+                moving += span->live_count_;
+            } else {
+                room += span->slot_count_ - span->live_count_;
+            }
+        }
+
+        // Переезд имеет смысл, только если новых спанов понадобится меньше, чем освободится
+        size_t slot_count = kPageSize / SizeClassSize(size_class);
+        size_t new_spans = moving > room ? (moving - room + slot_count - 1) / slot_count : 0;
+        if (candidates.empty() || new_spans >= candidates.size()) continue;
+
+        for (Span *span : candidates) {
+            partial_[size_class].Remove(span);
+            evacuated_.Push(span);
+        }
+        for (Span *span : candidates) {
+            EvacuateSpanLocked(span);
+        }
+        evacuated += candidates.size();
+    }
+
+    lock.unlock();
+    UnlockCaches();
+    return evacuated;
+}
+
+void Heap::ForEachObject(const std::function<void(void *ptr, ObjectMeta &meta)> &fn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto visit = [&fn](const SpanList &list) {
+        for (Span *span = list.head_; span; span = span->next_) {
+            for (uint32_t w = 0, words = span->BitmapWords(); w < words; ++w) {
+                for (uint64_t live = span->alloc_bits_[w].load(std::memory_order_relaxed); live; live &= live - 1) {
+                    uint32_t index = w * 64 + __builtin_ctzll(live);
+                    fn(span->SlotAddress(index), span->meta_[index]);
+                }
+            }
+        }
+    };
+    for (size_t i = 1; i < kNumSizeClasses; ++i) {
+        visit(partial_[i]);
+        visit(full_[i]);
+    }
+    visit(large_);
+    visit(evacuated_);
+}
+
+// Страницы опустевших спанов возвращаются системе сразу, не дожидаясь уборщика
+size_t Heap::FinishEvacuation() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t released = 0;
+    while (Span *span = evacuated_.head_) {
+        evacuated_.Remove(span);
+        delete[] span->forward_;
+        span->forward_ = nullptr;
+
+        if (span->live_count_ == 0) {
+            madvise(span->start_, span->pages_ * kPageSize, MADV_DONTNEED);
+            released += span->pages_ * kPageSize;
+            ReleasedSpanLocked(span);
+        } else if (span->live_count_ == span->slot_count_) {
+            full_[span->size_class_].Push(span);
+        } else {
+            partial_[span->size_class_].Push(span);
+        }
+    }
+    return released;
+}
+
+// free_pages_ пополняется с головы, поэтому дольше всех пустуют спаны в хвосте списка.
+// Выбранные спаны на время madvise не лежат ни в одном списке, и аллокатор их не увидит
+size_t Heap::Scavenge(std::chrono::nanoseconds min_idle) {
+    std::vector<Span*> idle;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto deadline = std::chrono::steady_clock::now() - min_idle;
+        Span *span = free_pages_.head_;
+        while (span && span->idle_since_ > deadline) {
+            span = span->next_;
+        }
+        while (span) {
+            Span *next = span->next_;
+            free_pages_.Remove(span);
+            idle_bytes_.fetch_sub(span->pages_ * kPageSize, std::memory_order_relaxed);
+            idle.push_back(span);
+            span = next;
+        }
+    }
+    if (idle.empty()) return 0;
+
+    size_t released = 0;
+    for (Span *span : idle) {
+        madvise(span->start_, span->pages_ * kPageSize, MADV_DONTNEED);
+        released += span->pages_ * kPageSize;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (Span *span : idle) {
+        released_pages_.Push(span);
+    }
+    return released;
+}
@@ -1,247 +1,1431 @@
 #include "gc_impl.h"
 
-void GarbageCollector::RemoveRoot(void *ptr) {
-    std::unique_lock<std::shared_mutex> lock(roots_mutex_);
-    roots_.erase(ptr);
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+// Поток держит gc_mutex_ через gc_block_collect — помогать маркировке ему нельзя
+thread_local bool collect_blocked_here = false;
+
+uint64_t ElapsedNs(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
 }
 
-void GarbageCollector::Mark() {
-    {
+// Верхняя граница корзины, в которую попадает доля quantile всех пауз
+uint64_t PauseQuantile(const GcStats &stats, double quantile) {
+    if (!stats.pause_count) return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * (stats.pause_count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        seen += stats.pause_histogram[i];
+        if (seen >= rank) {
+            uint64_t bound = i + 1 < 64 ? (uint64_t{1} << (i + 1)) - 1 : UINT64_MAX;
+            return std::min(bound, stats.pause_max_ns);
+        }
+    }
+    return stats.pause_max_ns;
+}
+
+}
+
+GarbageCollector::GarbageCollector() {
+    heap_.SetDeadObjectHook([this](Span *span, uint32_t index) {
+        return ReleaseObject(span, index);
+    });
+}
+
+GarbageCollector::~GarbageCollector() {
+    StopCollectorThread();
+    StopSweeper();
+    StopFinalizerThread();
+    for (size_t i = 1; i < types_count_.load(); ++i) {
+        delete types_[i].load();
+    }
+}
+
+uint16_t GarbageCollector::FinalizerIndex(FinalizerT finalizer) {
+    if (finalizer == DefaultFinalizer) return 0;
+
+    size_t count = finalizers_count_.load(std::memory_order_acquire);
+    for (size_t i = 1; i < count; ++i) {
+        if (finalizers_[i].load(std::memory_order_relaxed) == finalizer) return i;
+    }
+
+    std::unique_lock<std::mutex> lock(finalizers_mutex_);
+    count = finalizers_count_.load(std::memory_order_relaxed);
+    for (size_t i = 1; i < count; ++i) {
+        if (finalizers_[i].load(std::memory_order_relaxed) == finalizer) return i;
+    }
+    finalizers_[count].store(finalizer, std::memory_order_relaxed);
+    finalizers_count_.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+// Дескриптор списка рёбер публикуется атомарно: маркировка проверяет его без блокировки полосы
+void GarbageCollector::InsertEdge(void *parent, ObjectMeta *parent_meta, void *child) {
+    std::lock_guard<SpinLock> edges_lock(edges_.LockFor(parent));
+    if (!parent_meta->edges_) {
+        std::atomic_ref<uint32_t>(parent_meta->edges_).store(edges_.Create(), std::memory_order_release);
+    }
+    edges_.Get(parent_meta->edges_).Add(child);
+}
+
+void GarbageCollector::RemoveEdge(void *parent, ObjectMeta *parent_meta, void *child) {
+    std::lock_guard<SpinLock> edges_lock(edges_.LockFor(parent));
+    if (parent_meta->edges_) {
+        edges_.Get(parent_meta->edges_).Remove(child);
+    }
+}
+
+// Мутатор может передать указатель на любое поле объекта. Внутри сборщика объект всегда
+// представлен началом слота: по нему ищутся рёбра и корни и выбирается блокировка рёбер
+void* GarbageCollector::Resolve(void *ptr) const {
+    void *base = heap_.BaseOf(ptr);
+    return base ? base : ptr;
+}
+
+std::vector<void*> GarbageCollector::ResolveAll(void *const *ptrs, size_t count) const {
+    std::vector<void*> resolved(count);
+    for (size_t i = 0; i < count; ++i) {
+        resolved[i] = Resolve(ptrs[i]);
+    }
+    return resolved;
+}
+
+// Вызывается под gray_mutex_. Возвращает true, если объект стал серым
+bool GarbageCollector::Shade(void *ptr, ObjectRef ref) {
+    if (ref && ref.TryMark()) {
+        gray_objects_.push_back(ptr);
+        return true;
+    }
+    return false;
+}
+
+// Барьер удаления (SATB, Юаса): объект, на который снята ссылка во время маркировки,
+// отмечается — всё достижимое на её начало доживает до конца цикла
+void GarbageCollector::ShadeDeleted(void *ptr) {
+    if (!gc_in_progress_.load()) return;
+    ObjectRef ref = heap_.Find(ptr);
+    if (ref && !ref.IsMarked()) {
         std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-        std::unique_lock<std::shared_mutex> lock(roots_mutex_);
-        for (auto root : roots_) {
-            allocations_[root].color_ = Color::Gray;
-            gray_objects_.push_back(root);
+        if (Shade(ptr, ref)) {
+            barrier_hits_.fetch_add(1, std::memory_order_relaxed);
         }
     }
+}
 
-    while (!gray_objects_.empty()) {
-        void* current = gray_objects_.front();
-        gray_objects_.pop_front();
+// Малая маркировка старых объектов не отмечает и читает запомненное множество только из снимка,
+// поэтому ребро от старого родителя, добавленное во время неё, иначе осталось бы незамеченным
+bool GarbageCollector::NeedsInsertBarrier(ObjectRef parent_ref) const {
+    if (!gc_in_progress_.load()) return false;
+    return parent_ref.IsMarked() || (minor_marking_ && !parent_ref.IsYoung());
+}
+
+// Барьер вставки нужен только для указателей, которые мутатор держал с начала цикла
+// вне графа: ребёнок, подвешенный к уже просканированному родителю, иначе не будет найден.
+// Вызывается после вставки, то есть уже после блокировки рёбер родителя
+void GarbageCollector::ShadeInserted(ObjectRef parent_ref, void *child) {
+    if (!NeedsInsertBarrier(parent_ref)) return;
+    ObjectRef child_ref = heap_.Find(child);
+    if (child_ref && !child_ref.IsMarked()) {
+        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+        if (Shade(child, child_ref)) {
+            barrier_hits_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Барьер для пачки: отмечаются все ещё не отмеченные объекты, очередь серых блокируется один раз
+void GarbageCollector::ShadeMany(void *const *ptrs, size_t count) {
+    std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+    uint64_t shaded = 0;
+    for (size_t i = 0; i < count; ++i) {
+        shaded += Shade(ptrs[i], heap_.Find(ptrs[i]));
+    }
+    if (shaded) {
+        barrier_hits_.fetch_add(shaded, std::memory_order_relaxed);
+    }
+}
+
+// Вызывается внутри операции мутатора. Барьер поколений достаточно выполнить для одного молодого ребёнка
+void GarbageCollector::InsertEdges(void *parent, void *const *children, size_t count) {
+    ObjectRef parent_ref = heap_.Find(parent);
+    ObjectMeta &parent_meta = parent_ref.Meta();
+    {
+        std::lock_guard<SpinLock> edges_lock(edges_.LockFor(parent));
+        if (!parent_meta.edges_) {
+            std::atomic_ref<uint32_t>(parent_meta.edges_).store(edges_.Create(), std::memory_order_release);
+        }
+        edges_.Get(parent_meta.edges_).AddMany(children, count);
+    }
 
-        auto it = allocations_.find(current);
-        for (auto ref : it->second.edges) {
-            auto edge_it = allocations_.find(ref);
-            if (edge_it->second.color_ == Color::White) {
-                edge_it->second.color_ = Color::Gray;
-                gray_objects_.push_back(ref);
+    if (NeedsInsertBarrier(parent_ref)) {
+        ShadeMany(children, count);
+    }
+    if (!heap_.IsYoung(parent_ref)) {
+        for (size_t i = 0; i < count; ++i) {
+            ObjectRef child_ref = heap_.Find(children[i]);
+            if (child_ref && heap_.IsYoung(child_ref)) {
+                RememberEdge(parent, parent_ref, children[i]);
+                break;
             }
         }
-        it->second.color_ = Color::Black;
     }
+}
 
-    while (true) {
-        void* current = nullptr;
+// Барьер поколений: старый объект, получивший ссылку на молодой, попадает в запомненное множество.
+// Вызывается после вставки ребра
+void GarbageCollector::RememberEdge(void *parent, ObjectRef parent_ref, void *child) {
+    if (heap_.IsYoung(parent_ref)) return;
+    ObjectRef child_ref = heap_.Find(child);
+    if (!child_ref || !heap_.IsYoung(child_ref)) return;
+    if (parent_ref.span_->TryRemember(parent_ref.index_)) {
+        barrier_hits_.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(remembered_mutex_);
+        remembered_.push_back(parent);
+    }
+}
+
+// Мутатор пишет поля через StoreField, маркировка читает их параллельно
+void* GarbageCollector::LoadField(void *ptr, uint32_t offset) {
+    return std::atomic_ref<void*>(*reinterpret_cast<void**>(static_cast<char*>(ptr) + offset))
+        .load(std::memory_order_relaxed);
+}
 
+bool GarbageCollector::HasYoungChild(void *ptr, ObjectRef ref) {
+    ObjectMeta &meta = ref.Meta();
+    if (meta.type_) {
+        for (uint32_t offset : types_[meta.type_].load(std::memory_order_acquire)->offsets_) {
+            ObjectRef child_ref = heap_.Find(LoadField(ptr, offset));
+            if (child_ref && child_ref.IsYoung()) return true;
+        }
+    }
+    uint32_t handle = std::atomic_ref<uint32_t>(meta.edges_).load(std::memory_order_acquire);
+    if (!handle) return false;
+    std::lock_guard<SpinLock> edges_lock(edges_.LockFor(ptr));
+    for (auto child : edges_.Get(handle)) {
+        ObjectRef child_ref = heap_.Find(child);
+        if (child_ref && child_ref.IsYoung()) return true;
+    }
+    return false;
+}
+
+// Вызывается под gc_mutex_ после малой сборки: выбрасывает объекты, у которых не осталось
+// молодых детей, и добавляет повышенные, у которых они есть. Бит снимается до проверки детей,
+// так что барьер, вставивший ребро параллельно, либо виден проверке, либо добавит объект сам
+void GarbageCollector::RebuildRememberedSet(const std::vector<void*> &promoted) {
+    std::vector<void*> candidates;
+    {
+        std::unique_lock<std::mutex> lock(remembered_mutex_);
+        candidates.swap(remembered_);
+    }
+    for (void *ptr : candidates) {
+        ObjectRef ref = heap_.Find(ptr);
+        ref.span_->Forget(ref.index_);
+    }
+    candidates.insert(candidates.end(), promoted.begin(), promoted.end());
+
+    std::vector<void*> kept;
+    for (void *ptr : candidates) {
+        ObjectRef ref = heap_.Find(ptr);
+        if (HasYoungChild(ptr, ref) && ref.span_->TryRemember(ref.index_)) {
+            kept.push_back(ptr);
+        }
+    }
+    std::unique_lock<std::mutex> lock(remembered_mutex_);
+    remembered_.insert(remembered_.end(), kept.begin(), kept.end());
+}
+
+// push(child) получает каждого ребёнка, которого отметил этот поток. Возвращает число просмотренных рёбер,
+// их же вместе с самим объектом добавляет в work
+template <class Push>
+size_t GarbageCollector::ScanObject(void *ptr, Push &&push, MarkWork &work) {
+    ObjectRef ref = heap_.Find(ptr);
+    if (!ref || !ref.span_->IsAllocated(ref.index_)) return 0;
+    ObjectMeta &meta = ref.Meta();
+    size_t scanned = 0;
+    ++work.objects_;
+    work.bytes_ += ref.span_->ObjectSize(ref.index_);
+
+    // Поля типизированного объекта читаются прямо из его памяти; в очередь кладётся начало слота,
+    // чтобы смещения полей ребёнка отсчитывались от него
+    if (meta.type_) {
+        const TypeInfo *type = types_[meta.type_].load(std::memory_order_acquire);
+        for (uint32_t offset : type->offsets_) {
+            ObjectRef child_ref = heap_.Find(LoadField(ptr, offset));
+            if (!child_ref || (minor_marking_ && !child_ref.IsYoung())) continue;
+            if (child_ref.TryMark()) {
+                push(child_ref.span_->SlotAddress(child_ref.index_));
+            }
+        }
+        scanned += type->offsets_.size();
+    }
+    uint32_t handle = std::atomic_ref<uint32_t>(meta.edges_).load(std::memory_order_acquire);
+    if (!handle) {
+        work.edges_ += scanned;
+        return scanned;
+    }
+
+    std::lock_guard<SpinLock> edges_lock(edges_.LockFor(ptr));
+    const EdgeList &children = edges_.Get(handle);
+    for (auto child : children) {
+        ObjectRef child_ref = heap_.Find(child);
+        if (!child_ref || (minor_marking_ && !child_ref.IsYoung())) continue;
+        if (child_ref.TryMark()) {
+            push(child);
+        }
+    }
+    scanned += children.size();
+    work.edges_ += scanned;
+    return scanned;
+}
+
+// Вызывается под gray_mutex_. Хотя бы один объект обрабатывается при любом бюджете
+void GarbageCollector::DrainGrayObjects(MarkBudget budget) {
+    bool timed = budget.deadline_ != std::chrono::steady_clock::time_point::max();
+    size_t work_since_check = 0;
+    MarkWork done;
+    while (!gray_objects_.empty() && budget.objects_ > 0) {
+        void* current = gray_objects_.front();
+        gray_objects_.pop_front();
+        // Сам объект тоже стоит единицу работы, иначе листья обходились бы бесплатно
+        size_t work = ScanObject(current, [this](void *child) { gray_objects_.push_back(child); }, done) + 1;
+
+        --budget.objects_;
+        if (work >= budget.edges_) break;
+        budget.edges_ -= work;
+
+        work_since_check += work;
+        if (timed && work_since_check >= kClockCheckWork) {
+            work_since_check = 0;
+            if (std::chrono::steady_clock::now() >= budget.deadline_) break;
+        }
+    }
+    cycle_work_ += done;
+}
+
+// Дообработка при работающих мутаторах. Очередь забирается целиком, обход идёт по локальному стеку
+// без gray_mutex_: барьер ждёт блокировку только на время обмена, а не до конца маркировки
+void GarbageCollector::DrainGrayConcurrently() {
+    std::vector<void*> local;
+    MarkWork done;
+    for (;;) {
         {
             std::unique_lock<std::mutex> gray_lock(gray_mutex_);
             if (gray_objects_.empty()) break;
-            current = gray_objects_.front();
-            gray_objects_.pop_front();
+            local.assign(gray_objects_.begin(), gray_objects_.end());
+            gray_objects_.clear();
+        }
+        while (!local.empty()) {
+            void *current = local.back();
+            local.pop_back();
+            ScanObject(current, [&local](void *child) { local.push_back(child); }, done);
         }
+    }
+    cycle_work_ += done;
+}
 
-        {
-            Allocation* alloc = nullptr;
-            std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-            auto it = allocations_.find(current);
-            if (it == allocations_.end()) continue;
-            alloc = &it->second;
+// Останавливает мутаторов и возвращает момент начала паузы
+std::chrono::steady_clock::time_point GarbageCollector::StopMutators() {
+    auto stopped = std::chrono::steady_clock::now();
+    mutators_.StopAll();
+    return stopped;
+}
 
-            std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-            for (auto ref : alloc->edges) {
-                std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-                auto edge_it = allocations_.find(ref);
-                if (edge_it->second.color_ == Color::White) {
-                    edge_it->second.color_ = Color::Gray;
-                    gray_objects_.push_back(ref);
-                }
-            }
+// Пауза попадает в гистограмму; пишет в неё только поток, держащий gc_mutex_
+uint64_t GarbageCollector::ResumeMutators(std::chrono::steady_clock::time_point stopped) {
+    mutators_.ResumeAll();
+    uint64_t pause = ElapsedNs(stopped);
+    pause_histogram_[pause ? 63 - __builtin_clzll(pause) : 0].fetch_add(1, std::memory_order_relaxed);
+    if (pause > pause_max_ns_.load(std::memory_order_relaxed)) {
+        pause_max_ns_.store(pause, std::memory_order_relaxed);
+    }
+    return pause;
+}
 
-            alloc->color_ = Color::Black;
+// Корни уже отмечены в BeginMarking; если идёт инкрементальный цикл, его серые объекты дообрабатываются здесь
+void GarbageCollector::Mark() {
+    if (marker_.Threads() > 1) {
+        std::vector<void*> seeds;
+        {
+            std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+            seeds.assign(gray_objects_.begin(), gray_objects_.end());
+            gray_objects_.clear();
+        }
+        std::vector<MarkWork> work(marker_.Threads());
+        marker_.Run(seeds, [this, &work](void *object, WorkStealingDeque &local, size_t worker) {
+            ScanObject(object, [&local](void *child) { local.Push(child); }, work[worker]);
+        });
+        for (const MarkWork &done : work) {
+            cycle_work_ += done;
         }
     }
+
+    // Объекты, которые барьер записи успел перекрасить за время параллельной фазы; с одним потоком — весь обход
+    DrainGrayConcurrently();
 }
 
-void GarbageCollector::Sweep() {
-    std::unique_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-    for (auto it = allocations_.begin(); it != allocations_.end(); ) {
-        if (it->second.color_ == Color::White) {
-            if (it->second.ptr_) {
-                it->second.finalizer_(it->second.ptr_, it->second.size_);
-                free(it->second.ptr_);
-                it->second.ptr_ = nullptr;
-            }
-            it = allocations_.erase(it);
-        } else {
-            //it->second.color_ = Color::White;
-            ++it;
+// Мёртвый объект перед освобождением слота. Вызывается при подметании, в том числе из аллокатора
+// под блокировкой кучи, поэтому финализатор здесь не выполняется, а только ставится в очередь
+bool GarbageCollector::ReleaseObject(Span *span, uint32_t index) {
+    ObjectMeta &meta = span->meta_[index];
+    if (meta.edges_) {
+        edges_.Release(meta.edges_);
+        meta.edges_ = 0;
+    }
+    if (meta.finalizer_ == 0) return true;
+
+    {
+        std::unique_lock<std::mutex> lock(finalization_mutex_);
+        finalization_queue_.push_back(span->SlotAddress(index));
+    }
+    finalization_cv_.notify_one();
+    return false;
+}
+
+size_t GarbageCollector::RunFinalizers(size_t max) {
+    auto started = std::chrono::steady_clock::now();
+    size_t done = 0;
+    while (done < max) {
+        void *ptr;
+        {
+            std::unique_lock<std::mutex> lock(finalization_mutex_);
+            if (finalization_queue_.empty()) break;
+            ptr = finalization_queue_.front();
+            finalization_queue_.pop_front();
         }
+
+        ObjectRef ref = heap_.Find(ptr);
+        finalizers_[ref.Meta().finalizer_].load(std::memory_order_relaxed)(ptr, ref.span_->ObjectSize(ref.index_));
+        heap_.FreeFinalized(ref.span_, ref.index_);
+        ++done;
+    }
+    if (done) {
+        objects_finalized_.fetch_add(done, std::memory_order_relaxed);
+        finalize_ns_.fetch_add(ElapsedNs(started), std::memory_order_relaxed);
     }
+    return done;
 }
 
-void GarbageCollector::AddAllocation(void *ptr, size_t size, FinalizerT finalizer) {
-    std::unique_lock<std::shared_mutex> lock(allocations_mutex_);
-    allocations_[ptr] = {size, ptr, Color::White, {}, finalizer};
+// Без потока финализации очередь разбирает поток, завершивший цикл, уже отпустив блокировки
+void GarbageCollector::RunPendingFinalizers() {
+    if (!finalizer_thread_running_.load()) {
+        RunFinalizers(SIZE_MAX);
+    }
+}
+
+// Вызывается потоком, завершившим цикл, после того как он отпустил gc_mutex_:
+// обратный вызов может сам обращаться к сборщику
+void GarbageCollector::AfterCycle() {
+    RunPendingFinalizers();
+
+    std::vector<GcCycleStats> cycles;
+    GcCycleCallback callback;
+    void *arg;
+    {
+        std::unique_lock<std::mutex> lock(stats_mutex_);
+        cycles.swap(unreported_cycles_);
+        callback = cycle_callback_;
+        arg = cycle_callback_arg_;
+    }
+    if (!callback) return;
+    for (const GcCycleStats &cycle : cycles) {
+        callback(&cycle, arg);
+    }
 }
 
-void GarbageCollector::AddRootAllocation(void *ptr, size_t size, FinalizerT finalizer) {
-    std::unique_lock<std::shared_mutex> lock_alloc(allocations_mutex_);
-    std::unique_lock<std::shared_mutex> lock_roots(roots_mutex_);
-    allocations_[ptr] = {size, ptr, Color::White, {}, finalizer};
-    roots_.insert(ptr);
+// Вызывается под gc_mutex_ в начале цикла
+void GarbageCollector::MeasureAllocationRate() {
+    auto now = std::chrono::steady_clock::now();
+    size_t allocated = heap_.AllocatedBytes();
+    double seconds = std::chrono::duration<double>(now - last_report_time_).count();
+    cycle_allocation_rate_ = seconds > 0 ? (allocated - last_report_allocated_) / seconds : 0.0;
 }
 
-void GarbageCollector::AddAllocationWithParent(void *ptr, size_t size, void *parent, FinalizerT finalizer) {
-    std::unique_lock<std::shared_mutex> lock_alloc(allocations_mutex_);
-    std::unique_lock<std::shared_mutex> lock_roots(roots_mutex_);
-    allocations_[ptr] = {size, ptr, Color::White, {}, finalizer};
+// Вызывается под gc_mutex_, когда цикл завершён и подметание выполнено или запущено
+void GarbageCollector::PublishCycle(bool minor) {
+    GcCycleStats cycle{};
+    cycle.minor = minor;
+    cycle.initial_pause_ns = current_pauses_.initial_pause_ns;
+    cycle.final_pause_ns = current_pauses_.final_pause_ns;
+    cycle.mark_ns = current_pauses_.initial_pause_ns + current_pauses_.concurrent_mark_ns +
+                    current_pauses_.final_pause_ns;
+    cycle.objects_marked = cycle_work_.objects_;
+    cycle.bytes_marked = cycle_work_.bytes_;
+    cycle.edges_traced = cycle_work_.edges_;
+    cycle.allocation_rate = cycle_allocation_rate_;
+    cycle_work_ = MarkWork{};
 
-    auto parent_it = allocations_.find(parent);
-    auto child_it = allocations_.find(ptr);
-    parent_it->second.edges.insert(ptr);
+    Heap::SweepCounters swept = heap_.Swept();
+    cycle.sweep_ns = swept.sweep_ns_ - reported_sweep_.sweep_ns_;
+    cycle.objects_freed = swept.objects_freed_ - reported_sweep_.objects_freed_;
+    cycle.bytes_freed = swept.bytes_freed_ - reported_sweep_.bytes_freed_;
+    reported_sweep_ = swept;
+    uint64_t finalize_ns = finalize_ns_.load(std::memory_order_relaxed);
+    uint64_t finalized = objects_finalized_.load(std::memory_order_relaxed);
+    uint64_t barrier_hits = barrier_hits_.load(std::memory_order_relaxed);
+    cycle.finalize_ns = finalize_ns - reported_finalize_ns_;
+    cycle.objects_finalized = finalized - reported_finalized_;
+    cycle.barrier_hits = barrier_hits - reported_barrier_hits_;
+    reported_finalize_ns_ = finalize_ns;
+    reported_finalized_ = finalized;
+    reported_barrier_hits_ = barrier_hits;
+    last_report_allocated_ = heap_.AllocatedBytes();
+    last_report_time_ = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    last_pauses_ = current_pauses_;
+    ++(minor ? totals_.minor_cycles : totals_.full_cycles);
+    cycle.cycle = totals_.full_cycles + totals_.minor_cycles;
+    totals_.mark_ns += cycle.mark_ns;
+    totals_.objects_marked += cycle.objects_marked;
+    totals_.bytes_marked += cycle.bytes_marked;
+    totals_.edges_traced += cycle.edges_traced;
+    totals_.allocation_rate = cycle.allocation_rate;
+    if (!minor) {
+        totals_.live_bytes = last_marked_bytes_;
+    }
+    if (cycle_callback_) {
+        unreported_cycles_.push_back(cycle);
+    }
+}
+
+void GarbageCollector::StartFinalizerThread() {
+    if (finalizer_thread_running_.exchange(true)) return;
+    finalizer_thread_ = std::thread(&GarbageCollector::FinalizerThreadLoop, this);
+}
 
-    if (gc_in_progress_.load() &&
-        parent_it->second.color_ == Color::Black &&
-        child_it->second.color_ == Color::White) {
-        child_it->second.color_ = Color::Gray;
+void GarbageCollector::StopFinalizerThread() {
+    {
+        std::unique_lock<std::mutex> lock(finalization_mutex_);
+        if (!finalizer_thread_running_.exchange(false)) return;
+    }
+    finalization_cv_.notify_all();
+    finalizer_thread_.join();
+}
+
+void GarbageCollector::FinalizerThreadLoop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(finalization_mutex_);
+            finalization_cv_.wait(lock, [this] {
+                return !finalizer_thread_running_.load() || !finalization_queue_.empty();
+            });
+            if (!finalizer_thread_running_.load()) return;
+        }
+        RunFinalizers(kFinalizerBatch);
+    }
+}
+
+// Вызывается под gc_mutex_, когда очередь серых опустела. Мутатор мог снять ссылку, но ещё
+// не успеть выполнить барьер, поэтому маркировка завершается при остановленных мутаторах:
+// всё, что барьеры отметили к этому моменту, дообходится в паузе
+void GarbageCollector::FinishMarking() {
+    auto stopped = StopMutators();
+    current_pauses_.concurrent_mark_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stopped - mark_started_).count();
+    {
         std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-        gray_objects_.push_back(ptr);
+        DrainGrayObjects(MarkBudget{});
+    }
+
+    // Живой объём — просканированное за цикл и выделенное чёрным с его начала; обход кучи в паузе не нужен
+    last_cycle_end_ = heap_.AllocatedBytes();
+    last_marked_bytes_ = cycle_work_.bytes_ + (last_cycle_end_ - mark_start_allocated_);
+    last_minor_end_.store(last_cycle_end_);
+    UpdatePacerTargets();
+
+    // Полная сборка повышает всех выживших, молодых детей у старых объектов больше нет.
+    // Биты снимаются по самому множеству, а не по всей куче
+    {
+        std::unique_lock<std::mutex> lock(remembered_mutex_);
+        for (void *ptr : remembered_) {
+            ObjectRef ref = heap_.Find(ptr);
+            ref.span_->Forget(ref.index_);
         }
+        remembered_.clear();
+    }
+
+    heap_.StartSweep();
+    incremental_mark_.store(false);
+    gc_in_progress_.store(false);
+    current_pauses_.final_pause_ns = ResumeMutators(stopped);
+}
+
+// Вызывается под gc_mutex_ после FinishMarking. Мутаторы сюда не мешают: мёртвые объекты
+// им недоступны, а аллокатор сериализован блокировкой кучи
+void GarbageCollector::Sweep() {
+    GcSweepMode mode = sweep_mode_.load();
+    if (mode == GC_SWEEP_EAGER) {
+        heap_.FinishSweep();
+    } else if (mode == GC_SWEEP_CONCURRENT) {
+        {
+            std::unique_lock<std::mutex> lock(sweeper_mutex_);
+            sweep_requested_ = true;
+        }
+        sweeper_cv_.notify_one();
+    }
+}
+
+// Помощь маркировке может завершить цикл и остановить мутаторов, поэтому она идёт до входа в операцию
+void* GarbageCollector::Allocate(size_t size, FinalizerT finalizer) {
+    uint16_t finalizer_index = FinalizerIndex(finalizer);
+    AccountAllocation(size);
+    MutatorScope scope(mutators_);
+    void *ptr = heap_.Allocate(size, finalizer_index, 0);
+    if (ptr && trace_.Active()) {
+        trace_.Malloc(ptr, size, finalizer != DefaultFinalizer, nullptr);
+    }
+    return ptr;
+}
+
+// Возвращает 0, если поле выходит за объект или не выровнено под указатель
+uint32_t GarbageCollector::RegisterType(size_t size, const size_t *offsets, size_t count) {
+    auto type = std::make_unique<TypeInfo>();
+    type->size_ = size;
+    for (size_t i = 0; i < count; ++i) {
+        if (offsets[i] % alignof(void*) != 0 || offsets[i] + sizeof(void*) > size) return 0;
+        type->offsets_.push_back(offsets[i]);
+    }
+
+    std::unique_lock<std::mutex> lock(types_mutex_);
+    size_t index = types_count_.load(std::memory_order_relaxed);
+    if (index == kMaxTypes) return 0;
+    const TypeInfo *info = type.release();
+    types_[index].store(info, std::memory_order_release);
+    types_count_.store(index + 1, std::memory_order_release);
+    if (trace_.Active()) {
+        trace_.RegisterType(index, size, info->offsets_);
+    }
+    return index;
+}
+
+// Память обнуляется до того, как объект станет виден маркировке: мусор в полях она приняла бы за указатели
+void* GarbageCollector::AllocateTyped(uint32_t type) {
+    if (type == 0 || type >= types_count_.load(std::memory_order_acquire)) return nullptr;
+    size_t size = types_[type].load(std::memory_order_acquire)->size_;
+    AccountAllocation(size);
+    MutatorScope scope(mutators_);
+    void *ptr = heap_.Allocate(size, 0, type);
+    if (ptr) {
+        memset(ptr, 0, size);
+        if (trace_.Active()) {
+            trace_.MallocTyped(ptr, type);
+        }
+    }
+    return ptr;
+}
+
+// Запись в поле типизированного объекта с теми же барьерами, что у gc_swap_edge
+void GarbageCollector::StoreField(void *parent, void **field, void *value) {
+    MutatorScope scope(mutators_);
+    void *old = std::atomic_ref<void*>(*field).exchange(value, std::memory_order_relaxed);
+    if (old) {
+        ShadeDeleted(Resolve(old));
+    }
+    if (value) {
+        parent = Resolve(parent);
+        value = Resolve(value);
+        ObjectRef parent_ref = heap_.Find(parent);
+        ShadeInserted(parent_ref, value);
+        RememberEdge(parent, parent_ref, value);
+    }
+    if (trace_.Active()) {
+        void *base = Resolve(parent);
+        trace_.Store(base, reinterpret_cast<char*>(field) - static_cast<char*>(base), value ? Resolve(value) : nullptr);
+    }
+}
+
+void* GarbageCollector::AllocateRoot(size_t size, FinalizerT finalizer) {
+    void *ptr = Allocate(size, finalizer);
+    if (ptr) {
+        AddRoot(ptr);
+    }
+    return ptr;
+}
+
+void* GarbageCollector::AllocateWithParent(size_t size, void *parent, FinalizerT finalizer) {
+    uint16_t finalizer_index = FinalizerIndex(finalizer);
+    AccountAllocation(size);
+    MutatorScope scope(mutators_);
+    void *ptr = heap_.Allocate(size, finalizer_index, 0);
+    if (!ptr) return nullptr;
+
+    // Новый объект во время маркировки уже отмечен, барьер маркировки не нужен
+    parent = Resolve(parent);
+    ObjectRef parent_ref = heap_.Find(parent);
+    InsertEdge(parent, &parent_ref.Meta(), ptr);
+    RememberEdge(parent, parent_ref, ptr);
+    if (trace_.Active()) {
+        trace_.Malloc(ptr, size, finalizer != DefaultFinalizer, parent);
+    }
+    return ptr;
 }
 
 void GarbageCollector::AddRoot(void *ptr) {
-    std::unique_lock<std::shared_mutex> lock(roots_mutex_);
-    roots_.insert(ptr);
+    MutatorScope scope(mutators_);
+    ptr = Resolve(ptr);
+    roots_.Add(ptr);
+    // Корни уже просканированы в начале цикла, новый корень — как ребёнок чёрного родителя
+    if (gc_in_progress_.load()) {
+        ObjectRef ref = heap_.Find(ptr);
+        if (ref && !ref.IsMarked()) {
+            std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+            Shade(ptr, ref);
+        }
+    }
+    if (trace_.Active()) {
+        trace_.Root(TraceOp::kAddRoot, ptr);
+    }
 }
 
 void GarbageCollector::DeleteRoot(void *ptr) {
-    RemoveRoot(ptr);
+    MutatorScope scope(mutators_);
+    ptr = Resolve(ptr);
+    roots_.Remove(ptr);
+    ShadeDeleted(ptr);
+    if (trace_.Active()) {
+        trace_.Root(TraceOp::kDeleteRoot, ptr);
+    }
 }
 
 void GarbageCollector::AddEdge(void *parent, void *child) {
-    std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-    auto parent_it = allocations_.find(parent);
-    auto child_it = allocations_.find(child);
-    parent_it->second.edges.insert(child);
-
-    if (gc_in_progress_.load() &&
-        parent_it->second.color_ == Color::Black &&
-        child_it->second.color_ == Color::White) {
-        child_it->second.color_ = Color::Gray;
-        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-        gray_objects_.push_back(child);
-        }
+    MutatorScope scope(mutators_);
+    parent = Resolve(parent);
+    child = Resolve(child);
+    ObjectRef parent_ref = heap_.Find(parent);
+    InsertEdge(parent, &parent_ref.Meta(), child);
+    ShadeInserted(parent_ref, child);
+    RememberEdge(parent, parent_ref, child);
+    if (trace_.Active()) {
+        trace_.Edge(TraceOp::kAddEdge, parent, child);
+    }
 }
 
 void GarbageCollector::DeleteEdge(void *parent, void *child) {
-    std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-    allocations_[parent].edges.erase(child);
+    MutatorScope scope(mutators_);
+    parent = Resolve(parent);
+    child = Resolve(child);
+    RemoveEdge(parent, &heap_.Find(parent).Meta(), child);
+    ShadeDeleted(child);
+    if (trace_.Active()) {
+        trace_.Edge(TraceOp::kDeleteEdge, parent, child);
+    }
 }
 
 void GarbageCollector::SwapEdge(void *parent, void *child1, void *child2) {
-    std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
+    MutatorScope scope(mutators_);
+    parent = Resolve(parent);
+    child1 = Resolve(child1);
+    child2 = Resolve(child2);
+    ObjectRef parent_ref = heap_.Find(parent);
 
-    allocations_[parent].edges.erase(child1);
+    RemoveEdge(parent, &parent_ref.Meta(), child1);
+    InsertEdge(parent, &parent_ref.Meta(), child2);
+    ShadeDeleted(child1);
+    ShadeInserted(parent_ref, child2);
+    RememberEdge(parent, parent_ref, child2);
+    if (trace_.Active()) {
+        trace_.SwapEdge(parent, child1, child2);
+    }
+}
+
+void GarbageCollector::AddEdges(void *parent, void *const *children, size_t count) {
+    std::vector<void*> resolved = ResolveAll(children, count);
+    MutatorScope scope(mutators_);
+    parent = Resolve(parent);
+    InsertEdges(parent, resolved.data(), count);
+    if (trace_.Active()) {
+        trace_.AddEdges(parent, resolved.data(), count);
+    }
+}
 
-    auto parent_it = allocations_.find(parent);
-    auto child_it = allocations_.find(child2);
-    parent_it->second.edges.insert(child2);
+// Рёбра группируются по родителю, каждая группа добавляется одной пачкой
+void GarbageCollector::AddEdgesPairs(const GcEdge *edges, size_t count) {
+    std::vector<GcEdge> sorted(count);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = {Resolve(edges[i].parent), Resolve(edges[i].child)};
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const GcEdge &a, const GcEdge &b) {
+        return a.parent < b.parent;
+    });
 
-    if (gc_in_progress_.load() &&
-        parent_it->second.color_ == Color::Black &&
-        child_it->second.color_ == Color::White) {
-        child_it->second.color_ = Color::Gray;
-        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-        gray_objects_.push_back(child2);
+    MutatorScope scope(mutators_);
+    std::vector<void*> children;
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        children.clear();
+        for (end = begin; end < count && sorted[end].parent == sorted[begin].parent; ++end) {
+            children.push_back(sorted[end].child);
         }
+        InsertEdges(sorted[begin].parent, children.data(), children.size());
+        if (trace_.Active()) {
+            trace_.AddEdges(sorted[begin].parent, children.data(), children.size());
+        }
+    }
 }
 
+void GarbageCollector::AddRoots(void *const *ptrs, size_t count) {
+    std::vector<void*> resolved = ResolveAll(ptrs, count);
+    MutatorScope scope(mutators_);
+    roots_.AddMany(resolved.data(), count);
+    if (gc_in_progress_.load()) {
+        ShadeMany(resolved.data(), count);
+    }
+    if (trace_.Active()) {
+        trace_.Roots(TraceOp::kAddRoots, resolved.data(), count);
+    }
+}
+
+void GarbageCollector::DeleteRoots(void *const *ptrs, size_t count) {
+    std::vector<void*> resolved = ResolveAll(ptrs, count);
+    MutatorScope scope(mutators_);
+    roots_.RemoveMany(resolved.data(), count);
+    if (gc_in_progress_.load()) {
+        ShadeMany(resolved.data(), count);
+    }
+    if (trace_.Active()) {
+        trace_.Roots(TraceOp::kDeleteRoots, resolved.data(), count);
+    }
+}
+
+// Хэндл кладётся под спинлоком своего потока, как любая операция мутатора: снимок корней его
+// либо увидит, либо хэндл появится уже во время маркировки и будет отмечен, как новый корень.
+// Снятие хэндла барьера не требует и идёт без блокировок
+void GarbageCollector::PushHandle(void *ptr) {
+    MutatorScope scope(mutators_);
+    mutators_.Local().handles_.Push(ptr);
+    if (ptr && gc_in_progress_.load()) {
+        ObjectRef ref = heap_.FindAllocated(ptr);
+        if (ref && !ref.IsMarked()) {
+            std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+            Shade(ref.span_->SlotAddress(ref.index_), ref);
+        }
+    }
+    if (ptr && trace_.Active()) {
+        trace_.Root(TraceOp::kPushHandle, Resolve(ptr));
+    }
+}
+
+void GarbageCollector::PopHandle() {
+    void *ptr = mutators_.Local().handles_.Pop();
+    if (ptr && trace_.Active()) {
+        trace_.Root(TraceOp::kPopHandle, Resolve(ptr));
+    }
+}
 
 void GarbageCollector::BlockCollect() {
     gc_mutex_.lock();
+    collect_blocked_here = true;
 }
 
 void GarbageCollector::UnlockCollect() {
+    collect_blocked_here = false;
     gc_mutex_.unlock();
 }
 
 void GarbageCollector::CollectGarbage() {
+    if (trace_.Active()) {
+        trace_.Collect(TraceOp::kCollect);
+    }
     std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
-    gc_in_progress_.store(true);
+    BeginMarking();
 
+    Mark();
+    FinishMarking();
+    Sweep();
+    PublishCycle(false);
+    gc_lock.unlock();
+
+    AfterCycle();
+}
+
+// Полная сборка и затем уплотнение при остановленных мутаторах. Корни, консервативные корни
+// и закреплённые объекты остаются на месте: их адреса держит сам мутатор. Нетипизированные тоже:
+// указатели в их данных сборщику не видны и не были бы обновлены. Остальные объекты могут
+// переехать, ссылки на них в рёбрах, полях типизированных объектов и запомненном множестве обновляются
+size_t GarbageCollector::Compact() {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    BeginMarking();
+    Mark();
+    FinishMarking();
+    heap_.FinishSweep();
+    PublishCycle(false);
+
+    auto stopped = StopMutators();
+    CollectStackRoots();
+    std::unordered_set<void*> pinned(stack_roots_.begin(), stack_roots_.end());
+    roots_.ForEach([&pinned](void *root) {
+        pinned.insert(root);
+    });
     {
-        std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-        for (auto& allocation : allocations_) {
-            allocation.second.color_ = Color::White;
+        std::unique_lock<std::mutex> lock(pinned_mutex_);
+        pinned.insert(pinned_.begin(), pinned_.end());
+    }
+
+    size_t released = 0;
+    auto fixed = [this, &pinned](void *ptr) {
+        return pinned.count(ptr) > 0 || heap_.Find(ptr).Meta().type_ == 0;
+    };
+    if (heap_.Evacuate(kCompactOccupancyPercent, fixed)) {
+        auto forward = [this](void *ptr) { return heap_.Forwarded(ptr); };
+        heap_.ForEachObject([&](void *ptr, ObjectMeta &meta) {
+            if (meta.edges_) {
+                edges_.Get(meta.edges_).Rewrite(forward);
+            }
+            if (meta.type_) {
+                for (uint32_t offset : types_[meta.type_].load(std::memory_order_acquire)->offsets_) {
+                    auto *field = reinterpret_cast<void**>(static_cast<char*>(ptr) + offset);
+                    *field = forward(*field);
+                }
+            }
+        });
+        // Мутаторы могли запомнить объекты уже после FinishMarking
+        {
+            std::unique_lock<std::mutex> lock(remembered_mutex_);
+            for (void *&ptr : remembered_) {
+                ptr = forward(ptr);
+            }
         }
+        released = heap_.FinishEvacuation();
     }
+    ResumeMutators(stopped);
+    gc_lock.unlock();
 
-    Mark();
-    Sweep();
+    AfterCycle();
+    return released;
+}
 
-    gc_in_progress_.store(false);
+void GarbageCollector::Pin(void *ptr) {
+    ptr = Resolve(ptr);
+    std::unique_lock<std::mutex> lock(pinned_mutex_);
+    pinned_.insert(ptr);
 }
 
-size_t GarbageCollector::GetAllocationsCount() {
-    std::shared_lock<std::shared_mutex> lock(allocations_mutex_);
-    return allocations_.size();
+void GarbageCollector::Unpin(void *ptr) {
+    ptr = Resolve(ptr);
+    std::unique_lock<std::mutex> lock(pinned_mutex_);
+    pinned_.erase(ptr);
 }
 
-void GarbageCollector::StartIncrementalMark() {
+void GarbageCollector::CollectConcurrent() {
+    std::unique_lock<std::mutex> lock(collector_mutex_);
+    if (!collector_thread_.joinable()) {
+        collector_thread_ = std::thread(&GarbageCollector::CollectorLoop, this);
+    }
+    // Запрос, пришедший до начала ожидающей сборки, она и обслужит
+    if (collections_requested_ == collections_done_) {
+        ++collections_requested_;
+    }
+    collector_cv_.notify_all();
+}
+
+void GarbageCollector::WaitForCollection() {
+    std::unique_lock<std::mutex> lock(collector_mutex_);
+    uint64_t target = collections_requested_;
+    collector_cv_.wait(lock, [&] { return collections_done_ >= target; });
+}
+
+void GarbageCollector::StopCollectorThread() {
+    if (!collector_thread_.joinable()) return;
+    {
+        std::unique_lock<std::mutex> lock(collector_mutex_);
+        collector_stop_ = true;
+    }
+    collector_cv_.notify_all();
+    collector_thread_.join();
+    collector_stop_ = false;
+}
+
+void GarbageCollector::CollectorLoop() {
+    std::unique_lock<std::mutex> lock(collector_mutex_);
+    while (true) {
+        collector_cv_.wait(lock, [this] { return collector_stop_ || collections_requested_ != collections_done_; });
+        if (collector_stop_) return;
+        uint64_t target = collections_requested_;
+
+        lock.unlock();
+        CollectGarbage();
+        lock.lock();
+        collections_done_ = target;
+        collector_cv_.notify_all();
+    }
+}
+
+GcPauseInfo GarbageCollector::LastPauses() {
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    return last_pauses_;
+}
+
+GcStats GarbageCollector::Stats() {
+    GcStats stats;
+    {
+        std::unique_lock<std::mutex> lock(stats_mutex_);
+        stats = totals_;
+    }
+    Heap::SweepCounters swept = heap_.Swept();
+    stats.sweep_ns = swept.sweep_ns_;
+    stats.objects_freed = swept.objects_freed_;
+    stats.bytes_freed = swept.bytes_freed_;
+    stats.finalize_ns = finalize_ns_.load(std::memory_order_relaxed);
+    stats.objects_finalized = objects_finalized_.load(std::memory_order_relaxed);
+    stats.barrier_hits = barrier_hits_.load(std::memory_order_relaxed);
+    stats.allocated_bytes = heap_.AllocatedBytes();
+
+    stats.pause_count = 0;
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        stats.pause_histogram[i] = pause_histogram_[i].load(std::memory_order_relaxed);
+        stats.pause_count += stats.pause_histogram[i];
+    }
+    stats.pause_max_ns = pause_max_ns_.load(std::memory_order_relaxed);
+    stats.pause_p50_ns = PauseQuantile(stats, 0.5);
+    stats.pause_p99_ns = PauseQuantile(stats, 0.99);
+    return stats;
+}
+
+void GarbageCollector::SetCycleCallback(GcCycleCallback callback, void *arg) {
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    cycle_callback_ = callback;
+    cycle_callback_arg_ = arg;
+    if (!callback) {
+        unreported_cycles_.clear();
+    }
+}
+
+// Мутаторы работают параллельно: барьеры и аллокация чёрным действуют так же, как при полной сборке
+void GarbageCollector::CollectMinor() {
+    if (trace_.Active()) {
+        trace_.Collect(TraceOp::kCollectMinor);
+    }
     std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
-    incremental_mark_.store(true);
+    if (gc_in_progress_.load()) return;
+    heap_.FinishSweep();
+    MeasureAllocationRate();
+
+    std::vector<void*> remembered;
+    auto stopped = StopMutators();
+    heap_.StartAllocatingBlack();
+    minor_marking_.store(true);
     gc_in_progress_.store(true);
+    CollectStackRoots();
+    {
+        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+        roots_.ForEach([this](void *root) {
+            ObjectRef ref = heap_.Find(root);
+            if (ref && ref.IsYoung()) {
+                Shade(root, ref);
+            }
+        });
+        for (void *ptr : stack_roots_) {
+            ObjectRef ref = heap_.Find(ptr);
+            if (ref.IsYoung()) {
+                Shade(ptr, ref);
+            }
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(remembered_mutex_);
+        remembered = remembered_;
+    }
+    current_pauses_.initial_pause_ns = ResumeMutators(stopped);
+    mark_started_ = std::chrono::steady_clock::now();
+    if (minor_mark_hook_) {
+        minor_mark_hook_();
+    }
 
     {
-        std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-        for (auto& allocation : allocations_) {
-            allocation.second.color_ = Color::White;
+        // Старые объекты из запомненного множества сканируются, но сами не отмечаются
+        std::vector<void*> children;
+        MarkWork remembered_work;
+        for (void *parent : remembered) {
+            ScanObject(parent, [&children](void *child) { children.push_back(child); }, remembered_work);
         }
+        cycle_work_.edges_ += remembered_work.edges_;
+        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+        gray_objects_.insert(gray_objects_.end(), children.begin(), children.end());
+    }
+    DrainGrayConcurrently();
+
+    stopped = StopMutators();
+    current_pauses_.concurrent_mark_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stopped - mark_started_).count();
+    {
+        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+        DrainGrayObjects(MarkBudget{});
+    }
+    gc_in_progress_.store(false);
+    current_pauses_.final_pause_ns = ResumeMutators(stopped);
+
+    // Маркировка окончена, новые барьеры ничего не отмечают; аллокация чёрным действует до подметания
+    std::vector<void*> promoted = heap_.SweepYoung(kPromotionAge);
+    minor_marking_.store(false);
+    RebuildRememberedSet(promoted);
+    last_minor_end_.store(heap_.AllocatedBytes());
+    PublishCycle(true);
+    gc_lock.unlock();
+
+    AfterCycle();
+}
+
+void GarbageCollector::SetNurserySize(size_t bytes) {
+    nursery_bytes_.store(bytes);
+}
+
+bool GarbageCollector::NurseryFull() const {
+    size_t nursery = nursery_bytes_.load();
+    return nursery && heap_.AllocatedBytes() - last_minor_end_.load() >= nursery;
+}
+
+size_t GarbageCollector::GetAllocationsCount() {
+    return heap_.ObjectCount();
+}
+
+size_t GarbageCollector::GetIdleBytes() const {
+    return heap_.IdleBytes();
+}
+
+// Ставится, пока сборок нет: сам хук читается под gc_mutex_ без отдельной блокировки
+void GarbageCollector::SetMinorMarkHook(std::function<void()> hook) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    minor_mark_hook_ = std::move(hook);
+}
+
+bool GarbageCollector::RegisterThread() {
+    return stacks_.RegisterCurrentThread();
+}
+
+void GarbageCollector::UnregisterThread() {
+    stacks_.UnregisterCurrentThread();
+}
+
+// Вызывается в паузе. Если буфер переполнился, потоки отпускаются и останавливаются заново
+// с буфером вдвое больше — мутаторы всё это время стоят, так что граф не меняется
+void GarbageCollector::CollectStackRoots() {
+    stack_roots_.clear();
+    while (!stacks_.Empty()) {
+        stack_roots_.reserve(stack_roots_reserve_);
+        bool complete = stacks_.ScanAll([this](void *word) {
+            ObjectRef ref = heap_.FindAllocated(word);
+            if (!ref) return true;
+            if (stack_roots_.size() == stack_roots_.capacity()) return false;
+            stack_roots_.push_back(ref.span_->SlotAddress(ref.index_));
+            return true;
+        });
+        if (complete) break;
+        stack_roots_.clear();
+        stack_roots_reserve_ *= 2;
     }
 
+    // Хэндлы gc::Root дописываются, когда просмотренные потоки уже отпущены, — здесь можно выделять память
+    mutators_.ForEachStopped([this](MutatorRegistry::Mutator &mutator) {
+        mutator.handles_.ForEach([this](void *ptr) {
+            ObjectRef ref = heap_.FindAllocated(ptr);
+            if (ref) {
+                stack_roots_.push_back(ref.span_->SlotAddress(ref.index_));
+            }
+        });
+    });
+}
+
+// Вызывается под gc_mutex_. Повторный вызов во время инкрементального цикла ничего не меняет.
+// Пауза — только на включение барьеров и снимок корней
+void GarbageCollector::BeginMarking() {
+    heap_.FinishSweep();
+    if (gc_in_progress_.load()) return;
+    MeasureAllocationRate();
+
+    // Ожидаемая работа цикла — по единице на каждые 16 байт живых данных прошлого цикла.
+    // Её нужно успеть сделать, пока куча не дорастёт до цели
+    size_t allocated = heap_.AllocatedBytes();
+    mark_start_allocated_ = allocated;
+    size_t goal = heap_goal_.load();
+    size_t runway = std::max(goal > allocated ? goal - allocated : 0, kAssistBytes);
+    assist_work_per_byte_.store((last_marked_bytes_ / 16 + 1) / static_cast<double>(runway));
+
+    auto stopped = StopMutators();
+    heap_.StartAllocatingBlack();
+    gc_in_progress_.store(true);
+    CollectStackRoots();
     {
+        // Барьер мог положить в очередь объекты уже после окончания прошлой маркировки
         std::unique_lock<std::mutex> gray_lock(gray_mutex_);
-        std::shared_lock<std::shared_mutex> roots_lock(roots_mutex_);
         gray_objects_.clear();
-        for (auto root : roots_) {
-            allocations_[root].color_ = Color::Gray;
-            gray_objects_.push_back(root);
+        roots_.ForEach([this](void *root) {
+            Shade(root, heap_.Find(root));
+        });
+        for (void *ptr : stack_roots_) {
+            Shade(ptr, heap_.Find(ptr));
         }
-        mark_iterator_ = gray_objects_.begin();
     }
+    current_pauses_.initial_pause_ns = ResumeMutators(stopped);
+    mark_started_ = std::chrono::steady_clock::now();
 }
 
-void GarbageCollector::StepMark() {
-    if (!gc_in_progress_.load() || !incremental_mark_.load()) return;
+// Вызывается под gc_mutex_
+void GarbageCollector::UpdatePacerTargets() {
+    int percent = gc_percent_.load();
+    if (percent < 0) {
+        next_trigger_.store(SIZE_MAX);
+        heap_goal_.store(SIZE_MAX);
+        return;
+    }
+    size_t growth = std::max(last_marked_bytes_ / 100 * percent, kMinHeapGrowth);
+    heap_goal_.store(last_cycle_end_ + growth);
+    // Цикл стартует раньше цели, чтобы маркировка успела закончиться к её достижению
+    next_trigger_.store(last_cycle_end_ + growth / 8 * 7);
+}
 
-    std::shared_lock<std::shared_mutex> alloc_lock(allocations_mutex_);
-    std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+bool GarbageCollector::PacerTriggered() const {
+    return heap_.AllocatedBytes() >= next_trigger_.load();
+}
 
-    size_t processed = 0;
-    while (mark_iterator_ != gray_objects_.end() && processed < steps_per_increment_) {
-        void* current = *mark_iterator_;
-        if (current) {
-            auto it = allocations_.find(current);
-            if (it != allocations_.end()) {
-                for (auto ref : it->second.edges) {
-                    auto edge_it = allocations_.find(ref);
-                    if (edge_it->second.color_ == Color::White) {
-                        edge_it->second.color_ = Color::Gray;
-                        gray_objects_.push_back(ref);
-                    }
+// Учёт идёт крупными порциями на поток, так что общий счётчик не трогается на каждой аллокации
+void GarbageCollector::AccountAllocation(size_t size) {
+    thread_local size_t unaccounted = 0;
+    unaccounted += size;
+    if (unaccounted < kAssistBytes) return;
+
+    size_t bytes = unaccounted;
+    unaccounted = 0;
+    if (IsMarking()) {
+        MarkAssist(bytes);
+    } else if (background_collector_running_.load() && (PacerTriggered() || NurseryFull())) {
+        background_cv_.notify_one();
+    }
+}
+
+// Мутатор, выделяющий быстрее, чем идёт маркировка, отрабатывает пропорциональную долю.
+// Пока куча не дошла до цели, занятый сборщик не ждём; после неё помощь обязательна
+void GarbageCollector::MarkAssist(size_t bytes) {
+    if (collect_blocked_here || gc_percent_.load() < 0) return;
+
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_, std::defer_lock);
+    if (heap_.AllocatedBytes() >= heap_goal_.load()) {
+        gc_lock.lock();
+    } else if (!gc_lock.try_lock()) {
+        return;
+    }
+
+    MarkBudget budget;
+    budget.edges_ = static_cast<size_t>(bytes * assist_work_per_byte_.load()) + 1;
+    if (StepMarkLocked(budget, false)) {
+        gc_lock.unlock();
+        AfterCycle();
+    }
+}
+
+void GarbageCollector::SetGcPercent(int percent) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    gc_percent_.store(percent);
+    UpdatePacerTargets();
+}
+
+void GarbageCollector::SetScavengeDelay(int delay_ms) {
+    scavenge_delay_ms_.store(delay_ms);
+}
+
+void GarbageCollector::ScavengeIdle() {
+    int delay = scavenge_delay_ms_.load();
+    if (delay >= 0) {
+        heap_.Scavenge(std::chrono::milliseconds(delay));
+    }
+}
+
+// Недометённые спаны могут оказаться пустыми, поэтому сначала дометаем кучу
+size_t GarbageCollector::ReleaseMemory() {
+    heap_.FinishSweep();
+    return heap_.Scavenge(std::chrono::nanoseconds(0));
+}
+
+// Куча на момент начала записи пишется в трассу снимком в паузе, как в DumpHeap: типы, объекты,
+// поля-указатели и рёбра, корни и хэндлы gc::Root. Операции мутаторов пишутся только после снимка.
+// Слова стеков в снимок не попадают: при воспроизведении держать такие объекты нечем
+bool GarbageCollector::StartTrace(const char *path) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    heap_.FinishSweep();
+    auto stopped = StopMutators();
+    // Тип, зарегистрированный параллельно, попадёт либо в снимок, либо в трассу после него
+    std::unique_lock<std::mutex> types_lock(types_mutex_);
+    bool started = trace_.Start(path, [this](const void *ptr) {
+        ObjectRef ref = heap_.FindAllocated(ptr);
+        return ref ? ref.span_->ObjectSize(ref.index_) : size_t{0};
+    });
+    if (!started) {
+        types_lock.unlock();
+        ResumeMutators(stopped);
+        return false;
+    }
+
+    for (size_t i = 1; i < types_count_.load(std::memory_order_relaxed); ++i) {
+        const TypeInfo *type = types_[i].load(std::memory_order_relaxed);
+        trace_.RegisterType(i, type->size_, type->offsets_);
+    }
+    // Сначала объявляются все объекты, потом связи между ними
+    heap_.ForEachObject([this](void *ptr, ObjectMeta &meta) {
+        ObjectRef ref = heap_.Find(ptr);
+        trace_.Object(ptr, ref.span_->ObjectSize(ref.index_), meta.type_, meta.finalizer_ != 0);
+    });
+    std::vector<void*> children;
+    heap_.ForEachObject([&](void *ptr, ObjectMeta &meta) {
+        if (meta.type_) {
+            for (uint32_t offset : types_[meta.type_].load(std::memory_order_relaxed)->offsets_) {
+                ObjectRef child_ref = heap_.FindAllocated(LoadField(ptr, offset));
+                if (child_ref) {
+                    trace_.Store(ptr, offset, child_ref.span_->SlotAddress(child_ref.index_));
                 }
-                it->second.color_ = Color::Black;
             }
         }
-        ++mark_iterator_;
-        ++processed;
+        if (meta.edges_) {
+            const EdgeList &edges = edges_.Get(meta.edges_);
+            children.assign(edges.begin(), edges.end());
+            trace_.AddEdges(ptr, children.data(), children.size());
+        }
+    });
+
+    std::vector<void*> roots;
+    roots_.ForEach([&roots](void *root) {
+        roots.push_back(root);
+    });
+    if (!roots.empty()) {
+        trace_.Roots(TraceOp::kAddRoots, roots.data(), roots.size());
     }
+    mutators_.ForEachStopped([this](MutatorRegistry::Mutator &mutator) {
+        mutator.handles_.ForEach([this](void *ptr) {
+            ObjectRef ref = heap_.FindAllocated(ptr);
+            if (ref) {
+                trace_.Root(TraceOp::kPushHandle, ref.span_->SlotAddress(ref.index_));
+            }
+        });
+    });
+    trace_.Activate();
+    types_lock.unlock();
+    ResumeMutators(stopped);
+    return true;
+}
+
+size_t GarbageCollector::StopTrace() {
+    return trace_.Stop();
+}
 
-    if (mark_iterator_ == gray_objects_.end()) {
-        FinishIncrementalMark();
-        Sweep();
-        gc_in_progress_.store(false);
+bool GarbageCollector::IsAllocated(const void *ptr) {
+    ObjectRef ref = heap_.FindAllocated(ptr);
+    return ref && ref.span_->SlotAddress(ref.index_) == ptr;
+}
+
+// Обход кучи при остановленных мутаторах стоит не дороже маркировки: снимок копится в памяти,
+// а в файл пишется уже после паузы. Мусор, ещё не убранный сборкой, попадает в снимок как недостижимый
+bool GarbageCollector::DumpHeap(const char *path) {
+    SnapshotWriter snapshot;
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    heap_.FinishSweep();
+    auto stopped = StopMutators();
+    CollectStackRoots();
+
+    std::vector<void*> children;
+    heap_.ForEachObject([&](void *ptr, ObjectMeta &meta) {
+        children.clear();
+        if (meta.type_) {
+            for (uint32_t offset : types_[meta.type_].load(std::memory_order_acquire)->offsets_) {
+                ObjectRef child_ref = heap_.FindAllocated(LoadField(ptr, offset));
+                if (child_ref) {
+                    children.push_back(child_ref.span_->SlotAddress(child_ref.index_));
+                }
+            }
+        }
+        if (meta.edges_) {
+            const EdgeList &edges = edges_.Get(meta.edges_);
+            children.insert(children.end(), edges.begin(), edges.end());
+        }
+        ObjectRef ref = heap_.Find(ptr);
+        snapshot.Object(ptr, ref.span_->ObjectSize(ref.index_), meta.type_, meta.finalizer_, children);
+    });
+    roots_.ForEach([&snapshot](void *root) {
+        snapshot.Root(SnapshotRecord::kRoot, root);
+    });
+    for (void *ptr : stack_roots_) {
+        snapshot.Root(SnapshotRecord::kStackRoot, ptr);
     }
+    ResumeMutators(stopped);
+    gc_lock.unlock();
+
+    return snapshot.Save(path);
+}
+
+void GarbageCollector::StartIncrementalMark() {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    if (gc_in_progress_.load()) return;
+    incremental_mark_.store(true);
+    BeginMarking();
+}
+
+// Вызывается под gc_mutex_. Возвращает true, если цикл завершён. Без sweep_all куча и в режиме EAGER
+// остаётся неподметённой: шаг с бюджетом не должен платить за подметание всей кучи
+bool GarbageCollector::StepMarkLocked(const MarkBudget &budget, bool sweep_all) {
+    if (!gc_in_progress_.load() || !incremental_mark_.load()) return false;
+
+    bool finished;
+    {
+        std::unique_lock<std::mutex> gray_lock(gray_mutex_);
+
+        DrainGrayObjects(budget);
+        finished = gray_objects_.empty();
+    }
+
+    if (finished) {
+        FinishMarking();
+        if (sweep_all || sweep_mode_.load() != GC_SWEEP_EAGER) {
+            Sweep();
+        }
+        PublishCycle(false);
+    }
+    return finished;
+}
+
+void GarbageCollector::StepMark() {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    MarkBudget budget;
+    budget.objects_ = steps_per_increment_;
+    if (StepMarkLocked(budget, true)) {
+        gc_lock.unlock();
+        AfterCycle();
+    }
+}
+
+bool GarbageCollector::StepMarkFor(uint64_t budget_ns) {
+    MarkBudget budget;
+    budget.deadline_ = std::chrono::steady_clock::now() + std::chrono::nanoseconds(budget_ns);
+
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    bool finished = StepMarkLocked(budget, false);
+    // Оставшееся время — на подметание спанов, оставленных ленивым режимом
+    while (heap_.HasUnswept() && std::chrono::steady_clock::now() < budget.deadline_) {
+        if (!heap_.SweepSome(kBudgetSweepSpans)) {
+            break;
+        }
+    }
+    bool marking = IsMarking();
+    gc_lock.unlock();
+
+    if (finished) {
+        AfterCycle();
+    }
+    return !marking;
+}
+
+bool GarbageCollector::StepMarkWork(size_t edges) {
+    MarkBudget budget;
+    budget.edges_ = edges;
+
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    bool finished = StepMarkLocked(budget, false);
+    bool marking = IsMarking();
+    gc_lock.unlock();
+
+    if (finished) {
+        AfterCycle();
+    }
+    return !marking;
 }
 
 bool GarbageCollector::IsMarking() const {
@@ -250,7 +1434,65 @@ bool GarbageCollector::IsMarking() const {
 
 void GarbageCollector::FinishIncrementalMark() {
     std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
-    incremental_mark_ = false;
+    if (StepMarkLocked(MarkBudget{}, true)) {
+        gc_lock.unlock();
+        AfterCycle();
+    }
+}
+
+void GarbageCollector::SetStepsPerIncrement(size_t steps) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    steps_per_increment_ = steps;
+}
+
+void GarbageCollector::SetSweepMode(GcSweepMode mode) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    sweep_mode_.store(mode);
+    if (mode == GC_SWEEP_CONCURRENT) {
+        if (!sweeper_thread_.joinable()) {
+            sweeper_thread_ = std::thread(&GarbageCollector::SweeperLoop, this);
+        }
+        return;
+    }
+
+    StopSweeper();
+    if (mode == GC_SWEEP_EAGER) {
+        heap_.FinishSweep();
+    }
+}
+
+void GarbageCollector::StopSweeper() {
+    if (!sweeper_thread_.joinable()) return;
+    {
+        std::unique_lock<std::mutex> lock(sweeper_mutex_);
+        sweeper_stop_ = true;
+    }
+    sweeper_cv_.notify_one();
+    sweeper_thread_.join();
+    sweeper_stop_ = false;
+    sweep_requested_ = false;
+}
+
+// Подметает кучу после каждого цикла, по одному спану за раз: между спанами блокировка кучи
+// свободна, а финализаторы вызываются вовсе без неё. Недоподметённые спаны, если поток
+// не успел, дочищает аллокатор или следующий цикл
+void GarbageCollector::SweeperLoop() {
+    std::unique_lock<std::mutex> lock(sweeper_mutex_);
+    while (true) {
+        sweeper_cv_.wait(lock, [this] { return sweeper_stop_ || sweep_requested_; });
+        if (sweeper_stop_) return;
+        sweep_requested_ = false;
+
+        lock.unlock();
+        while (heap_.SweepOneConcurrent()) {
+        }
+        lock.lock();
+    }
+}
+
+void GarbageCollector::SetMarkThreads(size_t threads) {
+    std::unique_lock<std::shared_mutex> gc_lock(gc_mutex_);
+    marker_.SetThreads(threads);
 }
 
 void GarbageCollector::StartBackgroundCollector(size_t steps, int interval_ms) {
@@ -279,22 +1521,47 @@ bool GarbageCollector::IsBackgroundCollectorRunning() const {
 }
 
 void GarbageCollector::BackgroundCollectorLoop() {
+    auto last_full_cycle = std::chrono::steady_clock::now();
     while (background_collector_running_.load()) {
         {
+            // Без активного цикла поток будят аллокации, дошедшие до порога пейсера
             std::unique_lock<std::mutex> lock(background_mutex_);
             background_cv_.wait_for(lock,
                 std::chrono::milliseconds(background_collector_interval_),
-                [this] { return !background_collector_running_; });
+                [this] {
+                    return !background_collector_running_ ||
+                           (!gc_in_progress_.load() && (PacerTriggered() || NurseryFull()));
+                });
 
             if (!background_collector_running_.load()) {
                 break;
             }
         }
 
+        // Хвост ленивого подметания прошлого цикла дочищаем раньше, чем начинать новый
+        // Спаны, которые держит подметальщик, не ждём: иначе цикл крутится вхолостую
+        if (!gc_in_progress_.load() && heap_.HasUnswept() && heap_.SweepSome(kBackgroundSweepSpans)) {
+            continue;
+        }
+
         if (!gc_in_progress_.load()) {
+            // С отключённым пейсером полные циклы идут раз в интервал, как до его появления
+            auto now = std::chrono::steady_clock::now();
+            bool full_due = gc_percent_.load() < 0
+                ? now - last_full_cycle >= std::chrono::milliseconds(background_collector_interval_)
+                : PacerTriggered();
+            // Пока полная сборка не нужна, молодое поколение чистят малые
+            if (!full_due) {
+                if (NurseryFull()) {
+                    CollectMinor();
+                }
+                ScavengeIdle();
+                continue;
+            }
+            last_full_cycle = now;
             StartIncrementalMark();
         }
 
         StepMark();
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,68 @@
+#include "gc_mutator.h"
+
+namespace {
+
+struct LocalMutatorHolder {
+    MutatorRegistry *registry_{nullptr};
+    MutatorRegistry::Mutator *mutator_{nullptr};
+
+    ~LocalMutatorHolder() {
+        if (mutator_) {
+            registry_->Detach(mutator_);
+        }
+    }
+};
+
+thread_local LocalMutatorHolder local_mutator;
+
+// Поток, работающий с другим реестром, получает запись без регистрации: остановка его не ждёт
+thread_local MutatorRegistry::Mutator unregistered_mutator;
+
+}
+
+MutatorRegistry::Mutator& MutatorRegistry::Local() {
+    if (local_mutator.registry_ == this) return *local_mutator.mutator_;
+    if (local_mutator.registry_) return unregistered_mutator;
+
+    auto *mutator = new Mutator;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        mutator->next_ = head_;
+        if (head_) {
+            head_->prev_ = mutator;
+        }
+        head_ = mutator;
+    }
+    local_mutator.registry_ = this;
+    local_mutator.mutator_ = mutator;
+    return *mutator;
+}
+
+void MutatorRegistry::Detach(Mutator *mutator) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (mutator->prev_) {
+        mutator->prev_->next_ = mutator->next_;
+    } else {
+        head_ = mutator->next_;
+    }
+    if (mutator->next_) {
+        mutator->next_->prev_ = mutator->prev_;
+    }
+    delete mutator;
+}
+
+void MutatorRegistry::StopAll() {
+    mutex_.lock();
+    stopping_.store(true, std::memory_order_relaxed);
+    for (Mutator *mutator = head_; mutator; mutator = mutator->next_) {
+        mutator->lock_.lock();
+    }
+}
+
+void MutatorRegistry::ResumeAll() {
+    stopping_.store(false, std::memory_order_relaxed);
+    for (Mutator *mutator = head_; mutator; mutator = mutator->next_) {
+        mutator->lock_.unlock();
+    }
+    mutex_.unlock();
+}
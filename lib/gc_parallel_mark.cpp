@@ -0,0 +1,208 @@
+#include "gc_parallel_mark.h"
+
+#include <algorithm>
+
+namespace {
+
+constexpr int64_t kInitialDequeCapacity = 1024;
+
+}
+
+WorkStealingDeque::WorkStealingDeque() : array_(new Array(kInitialDequeCapacity)) {}
+
+WorkStealingDeque::~WorkStealingDeque() {
+    delete array_.load();
+}
+
+WorkStealingDeque::Array* WorkStealingDeque::Grow(Array *array, int64_t top, int64_t bottom) {
+    auto *grown = new Array(array->capacity_ * 2);
+    for (int64_t i = top; i < bottom; ++i) {
+        grown->Put(i, array->Get(i));
+    }
+    retired_.emplace_back(array);
+    array_.store(grown, std::memory_order_release);
+    return grown;
+}
+
+void WorkStealingDeque::Push(void *item) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Array *array = array_.load(std::memory_order_relaxed);
+    if (bottom - top > array->capacity_ - 1) {
+        array = Grow(array, top, bottom);
+    }
+    array->Put(bottom, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+}
+
+void* WorkStealingDeque::Pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *array = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    void *item = array->Get(bottom);
+    if (top == bottom) {
+        // Последний элемент — соревнуемся с ворами
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            item = nullptr;
+        }
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+void* WorkStealingDeque::Steal() {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) return nullptr;
+
+    void *item = array_.load(std::memory_order_acquire)->Get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return item;
+}
+
+bool WorkStealingDeque::Empty() const {
+    return top_.load(std::memory_order_acquire) >= bottom_.load(std::memory_order_acquire);
+}
+
+void WorkStealingDeque::ReleaseRetired() {
+    retired_.clear();
+}
+
+ParallelMarker::ParallelMarker() {
+    deques_.emplace_back(new WorkStealingDeque);
+}
+
+ParallelMarker::~ParallelMarker() {
+    StopThreads();
+}
+
+void ParallelMarker::StopThreads() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+    stop_ = false;
+}
+
+void ParallelMarker::SetThreads(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads == deques_.size()) return;
+
+    StopThreads();
+    deques_.clear();
+    for (size_t i = 0; i < threads; ++i) {
+        deques_.emplace_back(new WorkStealingDeque);
+    }
+    for (size_t i = 1; i < threads; ++i) {
+        threads_.emplace_back(&ParallelMarker::ThreadLoop, this, i, generation_);
+    }
+}
+
+void ParallelMarker::ThreadLoop(size_t id, uint64_t seen) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+        }
+
+        Work(id);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (--active_ == 0) {
+                done_cv_.notify_all();
+            }
+        }
+    }
+}
+
+void* ParallelMarker::StealFromOthers(size_t id) {
+    size_t count = deques_.size();
+    for (size_t i = 1; i < count; ++i) {
+        if (void *item = deques_[(id + i) % count]->Steal()) {
+            return item;
+        }
+    }
+    return nullptr;
+}
+
+bool ParallelMarker::AnyWork() const {
+    for (auto &deque : deques_) {
+        if (!deque->Empty()) return true;
+    }
+    return false;
+}
+
+void ParallelMarker::Work(size_t id) {
+    WorkStealingDeque &local = *deques_[id];
+    size_t count = deques_.size();
+    for (size_t i = id; i < seeds_->size(); i += count) {
+        local.Push((*seeds_)[i]);
+    }
+
+    while (true) {
+        while (void *object = local.Pop()) {
+            scan_(object, local, id);
+        }
+        if (void *object = StealFromOthers(id)) {
+            scan_(object, local, id);
+            continue;
+        }
+
+        // Свой дек пуст и украсть нечего. Маркировка закончена, когда простаивают все воркеры:
+        // работу кладут только владельцы деков, а простаивающий воркер ничего не кладёт
+        idle_.fetch_add(1);
+        while (true) {
+            if (idle_.load() == count) return;
+            if (AnyWork()) {
+                idle_.fetch_sub(1);
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ParallelMarker::Run(const std::vector<void*> &seeds, ScanFn scan) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        seeds_ = &seeds;
+        scan_ = std::move(scan);
+        idle_.store(0);
+        active_ = threads_.size();
+        ++generation_;
+    }
+    start_cv_.notify_all();
+
+    Work(0);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this] { return active_ == 0; });
+        scan_ = nullptr;
+        seeds_ = nullptr;
+    }
+    for (auto &deque : deques_) {
+        deque->ReleaseRetired();
+    }
+}
@@ -0,0 +1,54 @@
+#include "gc_roots.h"
+
+#include <algorithm>
+#include <vector>
+
+void RootSet::Add(void *ptr) {
+    Shard &shard = shards_[ShardIndex(ptr)];
+    std::lock_guard<SpinLock> lock(shard.lock_);
+    shard.roots_.insert(ptr);
+}
+
+void RootSet::Remove(void *ptr) {
+    Shard &shard = shards_[ShardIndex(ptr)];
+    std::lock_guard<SpinLock> lock(shard.lock_);
+    shard.roots_.erase(ptr);
+}
+
+// Сортировка подсчётом по номеру шарда; fn получает шард и его часть пачки
+template <class Fn>
+void RootSet::ForEachShardOf(void *const *ptrs, size_t count, Fn &&fn) {
+    size_t begin[kShards + 1] = {};
+    for (size_t i = 0; i < count; ++i) {
+        ++begin[ShardIndex(ptrs[i]) + 1];
+    }
+    for (size_t i = 0; i < kShards; ++i) {
+        begin[i + 1] += begin[i];
+    }
+    std::vector<void*> sorted(count);
+    size_t fill[kShards];
+    std::copy(begin, begin + kShards, fill);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[fill[ShardIndex(ptrs[i])]++] = ptrs[i];
+    }
+
+    for (size_t i = 0; i < kShards; ++i) {
+        if (begin[i] == begin[i + 1]) continue;
+        std::lock_guard<SpinLock> lock(shards_[i].lock_);
+        fn(shards_[i], sorted.data() + begin[i], sorted.data() + begin[i + 1]);
+    }
+}
+
+void RootSet::AddMany(void *const *ptrs, size_t count) {
+    ForEachShardOf(ptrs, count, [](Shard &shard, void **begin, void **end) {
+        shard.roots_.insert(begin, end);
+    });
+}
+
+void RootSet::RemoveMany(void *const *ptrs, size_t count) {
+    ForEachShardOf(ptrs, count, [](Shard &shard, void **begin, void **end) {
+        for (void **ptr = begin; ptr != end; ++ptr) {
+            shard.roots_.erase(*ptr);
+        }
+    });
+}
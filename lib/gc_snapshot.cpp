@@ -0,0 +1,340 @@
+#include "gc_snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+class SnapshotReader {
+    const uint8_t *pos_;
+    const uint8_t *end_;
+    uint64_t last_address_{0};
+    bool failed_{false};
+public:
+    SnapshotReader(const uint8_t *begin, const uint8_t *end) : pos_(begin), end_(end) {}
+
+    bool AtEnd() const {
+        return pos_ == end_;
+    }
+    bool Failed() const {
+        return failed_;
+    }
+    uint8_t ReadByte() {
+        return *pos_++;
+    }
+    uint64_t ReadVarint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64 && pos_ < end_; shift += 7) {
+            uint8_t byte = *pos_++;
+            value |= uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        failed_ = true;
+        pos_ = end_;
+        return 0;
+    }
+    uint64_t ReadAddress() {
+        uint64_t zigzag = ReadVarint();
+        last_address_ += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+        return last_address_;
+    }
+};
+
+}
+
+SnapshotWriter::SnapshotWriter() {
+    data_.append(kSnapshotMagic, sizeof(kSnapshotMagic));
+}
+
+void SnapshotWriter::WriteVarint(uint64_t value) {
+    while (value >= 0x80) {
+        data_.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    data_.push_back(static_cast<char>(value));
+}
+
+void SnapshotWriter::WriteAddress(const void *ptr) {
+    auto address = reinterpret_cast<uint64_t>(ptr);
+    auto delta = static_cast<int64_t>(address - last_address_);
+    WriteVarint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    last_address_ = address;
+}
+
+void SnapshotWriter::Object(const void *ptr, size_t size, uint32_t type, uint32_t finalizer,
+                            const std::vector<void*> &children) {
+    data_.push_back(static_cast<char>(SnapshotRecord::kObject));
+    WriteAddress(ptr);
+    WriteVarint(size);
+    WriteVarint(type);
+    WriteVarint(finalizer);
+    WriteVarint(children.size());
+    for (void *child : children) {
+        WriteAddress(child);
+    }
+}
+
+void SnapshotWriter::Root(SnapshotRecord record, const void *ptr) {
+    data_.push_back(static_cast<char>(record));
+    WriteAddress(ptr);
+}
+
+bool SnapshotWriter::Save(const std::string &path) const {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t written = 0;
+    while (written < data_.size()) {
+        ssize_t result = write(fd, data_.data() + written, data_.size() - written);
+        if (result <= 0) break;
+        written += result;
+    }
+    return close(fd) == 0 && written == data_.size();
+}
+
+size_t HeapSnapshot::Find(uint64_t address) const {
+    auto it = std::lower_bound(addresses_.begin(), addresses_.end(), address);
+    return it != addresses_.end() && *it == address ? it - addresses_.begin() : addresses_.size();
+}
+
+// Записи читаются в порядке файла, затем объекты сортируются по адресу, а адреса детей и корней
+// заменяются индексами
+bool ReadSnapshot(const std::string &path, HeapSnapshot &snapshot) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(kSnapshotMagic)) {
+        close(fd);
+        return false;
+    }
+    size_t file_size = info.st_size;
+    void *data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    const auto *begin = static_cast<const uint8_t*>(data);
+    if (memcmp(begin, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+        munmap(data, file_size);
+        return false;
+    }
+
+    struct RawObject {
+        uint64_t address_;
+        uint64_t size_;
+        uint32_t type_;
+        uint32_t finalizer_;
+        uint64_t children_begin_;
+        uint64_t children_end_;
+    };
+    std::vector<RawObject> objects;
+    std::vector<uint64_t> children;
+    std::vector<uint64_t> roots;
+    std::vector<uint64_t> stack_roots;
+
+    SnapshotReader reader(begin + sizeof(kSnapshotMagic), begin + file_size);
+    bool valid = true;
+    while (valid && !reader.AtEnd()) {
+        switch (static_cast<SnapshotRecord>(reader.ReadByte())) {
+        case SnapshotRecord::kObject: {
+            RawObject object;
+            object.address_ = reader.ReadAddress();
+            object.size_ = reader.ReadVarint();
+            object.type_ = reader.ReadVarint();
+            object.finalizer_ = reader.ReadVarint();
+            uint64_t count = reader.ReadVarint();
+            object.children_begin_ = children.size();
+            for (uint64_t i = 0; i < count && !reader.Failed(); ++i) {
+                children.push_back(reader.ReadAddress());
+            }
+            object.children_end_ = children.size();
+            objects.push_back(object);
+            break;
+        }
+        case SnapshotRecord::kRoot:
+            roots.push_back(reader.ReadAddress());
+            break;
+        case SnapshotRecord::kStackRoot:
+            stack_roots.push_back(reader.ReadAddress());
+            break;
+        default:
+            valid = false;
+        }
+        valid = valid && !reader.Failed();
+    }
+    munmap(data, file_size);
+    if (!valid || objects.size() >= DominatorTree::kUnreachable) return false;
+
+    std::sort(objects.begin(), objects.end(), [](const RawObject &a, const RawObject &b) {
+        return a.address_ < b.address_;
+    });
+    snapshot = HeapSnapshot{};
+    size_t count = objects.size();
+    snapshot.addresses_.resize(count);
+    snapshot.sizes_.resize(count);
+    snapshot.types_.resize(count);
+    snapshot.finalizers_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        snapshot.addresses_[i] = objects[i].address_;
+        snapshot.sizes_[i] = objects[i].size_;
+        snapshot.types_[i] = objects[i].type_;
+        snapshot.finalizers_[i] = objects[i].finalizer_;
+    }
+
+    snapshot.edge_begin_.reserve(count + 1);
+    snapshot.edges_.reserve(children.size());
+    for (const RawObject &object : objects) {
+        snapshot.edge_begin_.push_back(snapshot.edges_.size());
+        for (uint64_t i = object.children_begin_; i < object.children_end_; ++i) {
+            size_t child = snapshot.Find(children[i]);
+            if (child != count) {
+                snapshot.edges_.push_back(child);
+            }
+        }
+    }
+    snapshot.edge_begin_.push_back(snapshot.edges_.size());
+
+    auto resolve = [&snapshot, count](const std::vector<uint64_t> &addresses, std::vector<uint32_t> &indices) {
+        for (uint64_t address : addresses) {
+            size_t index = snapshot.Find(address);
+            if (index != count) {
+                indices.push_back(index);
+            }
+        }
+    };
+    resolve(roots, snapshot.roots_);
+    resolve(stack_roots, snapshot.stack_roots_);
+    return true;
+}
+
+DominatorTree ComputeDominators(const HeapSnapshot &snapshot) {
+    constexpr uint32_t kNone = DominatorTree::kUnreachable;
+    const uint32_t count = snapshot.ObjectCount();
+    const uint32_t root = count;
+    const size_t nodes = size_t{count} + 1;
+
+    std::vector<uint32_t> root_edges(snapshot.roots_);
+    root_edges.insert(root_edges.end(), snapshot.stack_roots_.begin(), snapshot.stack_roots_.end());
+    auto successors = [&](uint32_t v) -> std::pair<const uint32_t*, const uint32_t*> {
+        if (v == root) return {root_edges.data(), root_edges.data() + root_edges.size()};
+        const uint32_t *edges = snapshot.edges_.data();
+        return {edges + snapshot.edge_begin_[v], edges + snapshot.edge_begin_[v + 1]};
+    };
+
+    // Обратные рёбра в том же виде, что прямые
+    std::vector<uint64_t> pred_begin(nodes + 1, 0);
+    for (uint32_t v = 0; v < nodes; ++v) {
+        auto [begin, end] = successors(v);
+        for (const uint32_t *w = begin; w != end; ++w) {
+            ++pred_begin[*w + 1];
+        }
+    }
+    std::partial_sum(pred_begin.begin(), pred_begin.end(), pred_begin.begin());
+    std::vector<uint32_t> preds(pred_begin.back());
+    {
+        std::vector<uint64_t> fill(pred_begin.begin(), pred_begin.end() - 1);
+        for (uint32_t v = 0; v < nodes; ++v) {
+            auto [begin, end] = successors(v);
+            for (const uint32_t *w = begin; w != end; ++w) {
+                preds[fill[*w]++] = v;
+            }
+        }
+    }
+
+    // Обход в глубину от виртуального корня: dfn — номер в порядке обхода, vertex — обратное отображение
+    std::vector<uint32_t> dfn(nodes, kNone);
+    std::vector<uint32_t> parent(nodes, kNone);
+    std::vector<uint32_t> vertex;
+    vertex.reserve(nodes);
+    std::vector<std::pair<uint32_t, uint64_t>> stack;
+    dfn[root] = 0;
+    vertex.push_back(root);
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+        auto &[v, next] = stack.back();
+        auto [begin, end] = successors(v);
+        if (begin + next == end) {
+            stack.pop_back();
+            continue;
+        }
+        uint32_t w = begin[next++];
+        if (dfn[w] != kNone) continue;
+        dfn[w] = vertex.size();
+        vertex.push_back(w);
+        parent[w] = v;
+        stack.emplace_back(w, 0);
+    }
+
+    std::vector<uint32_t> semi(dfn);
+    std::vector<uint32_t> label(nodes);
+    std::iota(label.begin(), label.end(), 0);
+    std::vector<uint32_t> ancestor(nodes, kNone);
+    std::vector<uint32_t> idom(nodes, kNone);
+    std::vector<uint32_t> bucket(nodes, kNone);
+    std::vector<uint32_t> bucket_next(nodes, kNone);
+
+    // Вершина с наименьшим полудоминатором на пути леса к v; путь сжимается без рекурсии
+    std::vector<uint32_t> path;
+    auto eval = [&](uint32_t v) {
+        if (ancestor[v] == kNone) return v;
+        path.clear();
+        for (uint32_t x = v; ancestor[ancestor[x]] != kNone; x = ancestor[x]) {
+            path.push_back(x);
+        }
+        while (!path.empty()) {
+            uint32_t x = path.back();
+            path.pop_back();
+            uint32_t a = ancestor[x];
+            if (semi[label[a]] < semi[label[x]]) {
+                label[x] = label[a];
+            }
+            ancestor[x] = ancestor[a];
+        }
+        return label[v];
+    };
+
+    for (size_t i = vertex.size() - 1; i > 0; --i) {
+        uint32_t w = vertex[i];
+        for (uint64_t j = pred_begin[w]; j < pred_begin[w + 1]; ++j) {
+            uint32_t v = preds[j];
+            if (dfn[v] == kNone) continue;
+            uint32_t u = eval(v);
+            if (semi[u] < semi[w]) {
+                semi[w] = semi[u];
+            }
+        }
+        uint32_t s = vertex[semi[w]];
+        bucket_next[w] = bucket[s];
+        bucket[s] = w;
+
+        uint32_t p = parent[w];
+        ancestor[w] = p;
+        for (uint32_t v = bucket[p]; v != kNone; v = bucket_next[v]) {
+            uint32_t u = eval(v);
+            idom[v] = semi[u] < semi[v] ? u : p;
+        }
+        bucket[p] = kNone;
+    }
+    for (size_t i = 1; i < vertex.size(); ++i) {
+        uint32_t w = vertex[i];
+        if (idom[w] != vertex[semi[w]]) {
+            idom[w] = idom[idom[w]];
+        }
+    }
+    idom[root] = root;
+
+    // Доминатор раньше в порядке обхода, поэтому хватает одного прохода с конца
+    DominatorTree tree;
+    tree.retained_.assign(nodes, 0);
+    for (size_t i = vertex.size() - 1; i > 0; --i) {
+        uint32_t w = vertex[i];
+        tree.retained_[w] += snapshot.sizes_[w];
+        tree.retained_[idom[w]] += tree.retained_[w];
+    }
+    tree.idom_ = std::move(idom);
+    tree.reachable_ = vertex.size() - 1;
+    return tree;
+}
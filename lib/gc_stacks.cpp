@@ -0,0 +1,134 @@
+#include "gc_stacks.h"
+
+#include <cerrno>
+#include <csignal>
+#include <thread>
+
+namespace {
+
+// Тот же сигнал, что у Boehm GC на Linux: приложения им почти не пользуются
+constexpr int kSuspendSignal = SIGPWR;
+
+// Обработчик сигнала читает только этот указатель: у него тривиальная инициализация
+thread_local StackScanner::ThreadStack *current_stack = nullptr;
+
+// Завершившийся поток нельзя оставлять в списке: сигнал ему уже не доставить
+struct LocalStackHolder {
+    StackScanner *owner_{nullptr};
+
+    ~LocalStackHolder() {
+        if (owner_) {
+            owner_->UnregisterCurrentThread();
+        }
+    }
+};
+
+thread_local LocalStackHolder local_stack_holder;
+
+}
+
+void StackScanner::SuspendHandler(int) {
+    ThreadStack *self = current_stack;
+    if (!self) return;
+    int saved_errno = errno;
+
+    // Эпоха читается до того, как поток объявит себя остановленным, — раньше сборщик её не сменит
+    StackScanner *owner = self->owner_;
+    uint64_t epoch = owner->resume_epoch_.load(std::memory_order_acquire);
+    setjmp(self->registers_);
+    self->stack_low_ = StackLow();
+    self->suspended_.store(true, std::memory_order_release);
+    while (owner->resume_epoch_.load(std::memory_order_acquire) == epoch) {
+        std::this_thread::yield();
+    }
+    self->suspended_.store(false, std::memory_order_release);
+
+    errno = saved_errno;
+}
+
+void StackScanner::InstallHandler() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction action {};
+        action.sa_handler = SuspendHandler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(kSuspendSignal, &action, nullptr);
+    });
+}
+
+__attribute__((noinline)) char* StackScanner::StackLow() {
+    return static_cast<char*>(__builtin_frame_address(0));
+}
+
+bool StackScanner::RegisterCurrentThread() {
+    if (current_stack) return true;
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return false;
+    void *stack_addr;
+    size_t stack_size;
+    int result = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+    pthread_attr_destroy(&attr);
+    if (result != 0) return false;
+
+    InstallHandler();
+    local_stack_holder.owner_ = this;
+    auto *stack = new ThreadStack;
+    stack->owner_ = this;
+    stack->thread_ = pthread_self();
+    stack->stack_top_ = static_cast<char*>(stack_addr) + stack_size;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    stack->next_ = head_;
+    if (head_) {
+        head_->prev_ = stack;
+    }
+    head_ = stack;
+    empty_.store(false, std::memory_order_relaxed);
+    current_stack = stack;
+    return true;
+}
+
+void StackScanner::UnregisterCurrentThread() {
+    ThreadStack *stack = current_stack;
+    if (!stack) return;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stack->prev_) {
+        stack->prev_->next_ = stack->next_;
+    } else {
+        head_ = stack->next_;
+    }
+    if (stack->next_) {
+        stack->next_->prev_ = stack->prev_;
+    }
+    empty_.store(head_ == nullptr, std::memory_order_relaxed);
+    current_stack = nullptr;
+    lock.unlock();
+    delete stack;
+}
+
+// Вызывается под mutex_
+void StackScanner::SuspendOthers(ThreadStack *self) {
+    for (ThreadStack *stack = head_; stack; stack = stack->next_) {
+        if (stack != self) {
+            pthread_kill(stack->thread_, kSuspendSignal);
+        }
+    }
+    for (ThreadStack *stack = head_; stack; stack = stack->next_) {
+        while (stack != self && !stack->suspended_.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Следующая остановка не должна принять потоки, ещё не вышедшие из обработчика, за остановленные
+void StackScanner::ResumeOthers(ThreadStack *self) {
+    resume_epoch_.fetch_add(1, std::memory_order_release);
+    for (ThreadStack *stack = head_; stack; stack = stack->next_) {
+        while (stack != self && stack->suspended_.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,510 @@
+#include "gc_trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "gc_impl.h"
+
+namespace {
+
+constexpr size_t kTraceChunk = size_t{4} << 20;
+
+void EmptyFinalizer(void*, size_t) {}
+
+}
+
+TraceWriter::~TraceWriter() {
+    Close();
+}
+
+bool TraceWriter::Open(const std::string &path) {
+    Close();
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) return false;
+    if (!Grow(kTraceChunk)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+// Файл продлевается и отображается заново целиком. При неудаче запись дальше теряется
+bool TraceWriter::Grow(size_t need) {
+    size_t capacity = std::max(capacity_ * 2, kTraceChunk);
+    while (capacity < need) {
+        capacity *= 2;
+    }
+    if (data_) {
+        munmap(data_, capacity_);
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+    if (ftruncate(fd_, capacity) != 0) return false;
+    void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) return false;
+    data_ = static_cast<char*>(data);
+    capacity_ = capacity;
+    return true;
+}
+
+void TraceWriter::Close() {
+    if (data_) {
+        munmap(data_, capacity_);
+        data_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        if (ftruncate(fd_, size_) != 0) {
+            // Хвост файла останется заполнен нулями, читатель примет его за конец трассы
+        }
+        close(fd_);
+        fd_ = -1;
+    }
+    size_ = 0;
+    capacity_ = 0;
+}
+
+void TraceWriter::Write(const void *bytes, size_t count) {
+    if (size_ + count > capacity_ && !Grow(size_ + count)) return;
+    memcpy(data_ + size_, bytes, count);
+    size_ += count;
+}
+
+void TraceWriter::WriteVarint(uint64_t value) {
+    uint8_t buffer[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = static_cast<uint8_t>(value);
+    Write(buffer, length);
+}
+
+bool TraceRecorder::Start(const std::string &path, SizeFn size_of) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (open_ || !writer_.Open(path)) return false;
+    writer_.Write(kTraceMagic, sizeof(kTraceMagic));
+    ids_.clear();
+    ids_[nullptr] = 0;
+    next_id_ = 1;
+    last_id_ = 0;
+    events_ = 0;
+    size_of_ = std::move(size_of);
+    open_ = true;
+    return true;
+}
+
+void TraceRecorder::Activate() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (open_) {
+        active_.store(true);
+    }
+}
+
+size_t TraceRecorder::Stop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return 0;
+    open_ = false;
+    active_.store(false);
+    writer_.Close();
+    ids_.clear();
+    return events_;
+}
+
+void TraceRecorder::Begin(TraceOp op) {
+    auto byte = static_cast<uint8_t>(op);
+    writer_.Write(&byte, 1);
+    ++events_;
+}
+
+// Адрес мёртвого объекта может достаться новому, поэтому номер всегда перезаписывается
+void TraceRecorder::NewObject(const void *ptr) {
+    ids_[ptr] = next_id_;
+    last_id_ = next_id_++;
+}
+
+void TraceRecorder::Declare(const void *ptr) {
+    if (ids_.count(ptr)) return;
+    Begin(TraceOp::kObject);
+    writer_.WriteVarint(size_of_(ptr));
+    NewObject(ptr);
+}
+
+void TraceRecorder::WriteId(const void *ptr) {
+    uint64_t id = ids_[ptr];
+    int64_t delta = static_cast<int64_t>(id - last_id_);
+    writer_.WriteVarint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    if (id) {
+        last_id_ = id;
+    }
+}
+
+void TraceRecorder::Object(const void *ptr, size_t size, uint32_t type, bool managed) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_ || ids_.count(ptr)) return;
+    if (type) {
+        Begin(TraceOp::kObjectTyped);
+        writer_.WriteVarint(type);
+    } else {
+        Begin(managed ? TraceOp::kObjectManaged : TraceOp::kObject);
+        writer_.WriteVarint(size);
+    }
+    NewObject(ptr);
+}
+
+void TraceRecorder::Malloc(const void *ptr, size_t size, bool managed, const void *parent) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    if (parent) {
+        Declare(parent);
+        Begin(managed ? TraceOp::kMallocWithParentManaged : TraceOp::kMallocWithParent);
+        writer_.WriteVarint(size);
+        WriteId(parent);
+    } else {
+        Begin(managed ? TraceOp::kMallocManaged : TraceOp::kMalloc);
+        writer_.WriteVarint(size);
+    }
+    NewObject(ptr);
+}
+
+void TraceRecorder::MallocTyped(const void *ptr, uint32_t type) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Begin(TraceOp::kMallocTyped);
+    writer_.WriteVarint(type);
+    NewObject(ptr);
+}
+
+void TraceRecorder::RegisterType(uint32_t type, size_t size, const std::vector<uint32_t> &offsets) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Begin(TraceOp::kRegisterType);
+    writer_.WriteVarint(type);
+    writer_.WriteVarint(size);
+    writer_.WriteVarint(offsets.size());
+    for (uint32_t offset : offsets) {
+        writer_.WriteVarint(offset);
+    }
+}
+
+void TraceRecorder::Store(const void *parent, size_t offset, const void *value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Declare(parent);
+    Declare(value);
+    Begin(TraceOp::kStore);
+    WriteId(parent);
+    writer_.WriteVarint(offset);
+    WriteId(value);
+}
+
+void TraceRecorder::Edge(TraceOp op, const void *parent, const void *child) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Declare(parent);
+    Declare(child);
+    Begin(op);
+    WriteId(parent);
+    WriteId(child);
+}
+
+void TraceRecorder::SwapEdge(const void *parent, const void *child1, const void *child2) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Declare(parent);
+    Declare(child1);
+    Declare(child2);
+    Begin(TraceOp::kSwapEdge);
+    WriteId(parent);
+    WriteId(child1);
+    WriteId(child2);
+}
+
+void TraceRecorder::AddEdges(const void *parent, void *const *children, size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Declare(parent);
+    for (size_t i = 0; i < count; ++i) {
+        Declare(children[i]);
+    }
+    Begin(TraceOp::kAddEdges);
+    WriteId(parent);
+    writer_.WriteVarint(count);
+    for (size_t i = 0; i < count; ++i) {
+        WriteId(children[i]);
+    }
+}
+
+void TraceRecorder::Root(TraceOp op, const void *ptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Declare(ptr);
+    Begin(op);
+    WriteId(ptr);
+}
+
+void TraceRecorder::Roots(TraceOp op, void *const *ptrs, size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    for (size_t i = 0; i < count; ++i) {
+        Declare(ptrs[i]);
+    }
+    Begin(op);
+    writer_.WriteVarint(count);
+    for (size_t i = 0; i < count; ++i) {
+        WriteId(ptrs[i]);
+    }
+}
+
+void TraceRecorder::Collect(TraceOp op) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return;
+    Begin(op);
+}
+
+TraceReader::~TraceReader() {
+    if (data_) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+}
+
+bool TraceReader::Open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(kTraceMagic)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = info.st_size;
+    pos_ = sizeof(kTraceMagic);
+    return memcmp(data_, kTraceMagic, sizeof(kTraceMagic)) == 0;
+}
+
+bool TraceReader::Next(TraceOp &op) {
+    if (pos_ >= size_) return false;
+    op = static_cast<TraceOp>(data_[pos_++]);
+    return true;
+}
+
+uint64_t TraceReader::ReadVarint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (pos_ >= size_) break;
+        uint8_t byte = data_[pos_++];
+        value |= uint64_t{byte & 0x7fu} << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    failed_ = true;
+    return 0;
+}
+
+uint64_t TraceReader::ReadId() {
+    uint64_t zigzag = ReadVarint();
+    uint64_t id = last_id_ + ((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    if (id) {
+        last_id_ = id;
+    }
+    return id;
+}
+
+uint64_t TraceReader::NewId() {
+    last_id_ = next_id_;
+    return next_id_++;
+}
+
+size_t ReplayTrace(const std::string &path) {
+    TraceReader reader;
+    if (!reader.Open(path)) return SIZE_MAX;
+
+    GarbageCollector &gc = GarbageCollector::GetInstance();
+    // Номер объекта в трассе -> его адрес при воспроизведении; нулевой номер — nullptr
+    std::vector<void*> objects(1, nullptr);
+    // Адрес -> номер последнего созданного по нему объекта: номер мёртвого объекта,
+    // чей адрес уже достался другому, недействителен
+    std::unordered_map<void*, uint64_t> owners;
+    std::vector<uint32_t> types(1, 0);
+    // Число хэндлов на объект; объект с хэндлами висит на служебном корне anchor
+    std::vector<uint32_t> handles;
+    void *anchor = nullptr;
+    std::vector<void*> batch;
+    // Событие сослалось на объект, которого нет: дальше воспроизводить нельзя
+    bool invalid = false;
+    auto object = [&](uint64_t id, bool required) -> void* {
+        void *ptr = id < objects.size() ? objects[id] : nullptr;
+        if (!id && !required) return nullptr;
+        if (!ptr || owners[ptr] != id || !gc.IsAllocated(ptr)) {
+            invalid = true;
+            return nullptr;
+        }
+        return ptr;
+    };
+    auto created = [&objects, &owners](uint64_t id, void *ptr) {
+        if (objects.size() <= id) {
+            objects.resize(id + 1);
+        }
+        objects[id] = ptr;
+        if (ptr) {
+            owners[ptr] = id;
+        }
+    };
+    auto read_batch = [&] {
+        batch.resize(reader.ReadVarint());
+        for (void *&ptr : batch) {
+            ptr = object(reader.ReadId(), false);
+        }
+    };
+    auto finish = [&anchor](size_t result) {
+        if (anchor) {
+            gc_delete_root(anchor);
+        }
+        return result;
+    };
+
+    size_t events = 0;
+    TraceOp op;
+    while (reader.Next(op)) {
+        switch (op) {
+        case TraceOp::kMalloc:
+        case TraceOp::kMallocManaged:
+        case TraceOp::kObject:
+        case TraceOp::kObjectManaged: {
+            size_t size = reader.ReadVarint();
+            bool managed = op == TraceOp::kMallocManaged || op == TraceOp::kObjectManaged;
+            void *ptr = managed ? gc_malloc_manage(size, EmptyFinalizer) : gc_malloc(size);
+            created(reader.NewId(), ptr);
+            break;
+        }
+        case TraceOp::kMallocWithParent:
+        case TraceOp::kMallocWithParentManaged: {
+            size_t size = reader.ReadVarint();
+            void *parent = object(reader.ReadId(), true);
+            if (invalid) break;
+            void *ptr = op == TraceOp::kMallocWithParentManaged
+                ? gc_malloc_with_parent_manage(size, parent, EmptyFinalizer)
+                : gc_malloc_with_parent(size, parent);
+            created(reader.NewId(), ptr);
+            break;
+        }
+        case TraceOp::kMallocTyped:
+        case TraceOp::kObjectTyped: {
+            uint64_t type = reader.ReadVarint();
+            created(reader.NewId(), gc_malloc_typed(type < types.size() ? types[type] : 0));
+            break;
+        }
+        case TraceOp::kRegisterType: {
+            uint64_t type = reader.ReadVarint();
+            size_t size = reader.ReadVarint();
+            std::vector<size_t> offsets(reader.ReadVarint());
+            for (size_t &offset : offsets) {
+                offset = reader.ReadVarint();
+            }
+            if (types.size() <= type) {
+                types.resize(type + 1);
+            }
+            types[type] = gc_register_type(size, offsets.data(), offsets.size());
+            break;
+        }
+        case TraceOp::kStore: {
+            void *parent = object(reader.ReadId(), true);
+            size_t offset = reader.ReadVarint();
+            void *value = object(reader.ReadId(), false);
+            if (invalid) break;
+            gc_store(parent, reinterpret_cast<void**>(static_cast<char*>(parent) + offset), value);
+            break;
+        }
+        case TraceOp::kAddEdge:
+        case TraceOp::kDeleteEdge: {
+            void *parent = object(reader.ReadId(), true);
+            void *child = object(reader.ReadId(), false);
+            if (invalid) break;
+            if (op == TraceOp::kAddEdge) {
+                gc_add_edge(parent, child);
+            } else {
+                gc_del_edge(parent, child);
+            }
+            break;
+        }
+        case TraceOp::kSwapEdge: {
+            void *parent = object(reader.ReadId(), true);
+            void *child1 = object(reader.ReadId(), false);
+            void *child2 = object(reader.ReadId(), false);
+            if (invalid) break;
+            gc_swap_edge(parent, child1, child2);
+            break;
+        }
+        case TraceOp::kAddEdges: {
+            void *parent = object(reader.ReadId(), true);
+            read_batch();
+            if (invalid) break;
+            gc_add_edges(parent, batch.data(), batch.size());
+            break;
+        }
+        case TraceOp::kAddRoot:
+        case TraceOp::kDeleteRoot: {
+            void *ptr = object(reader.ReadId(), false);
+            if (invalid) break;
+            if (op == TraceOp::kAddRoot) {
+                gc_add_root(ptr);
+            } else {
+                gc_delete_root(ptr);
+            }
+            break;
+        }
+        case TraceOp::kAddRoots:
+        case TraceOp::kDeleteRoots:
+            read_batch();
+            if (invalid) break;
+            if (op == TraceOp::kAddRoots) {
+                gc_add_roots(batch.data(), batch.size());
+            } else {
+                gc_delete_roots(batch.data(), batch.size());
+            }
+            break;
+        // Хэндлы разных потоков в трассе перемешаны, поэтому стек хэндлов не воспроизводится:
+        // объект держится, пока на него есть хоть один хэндл
+        case TraceOp::kPushHandle:
+        case TraceOp::kPopHandle: {
+            uint64_t id = reader.ReadId();
+            void *ptr = object(id, false);
+            if (!ptr) break;
+            if (handles.size() <= id) {
+                handles.resize(id + 1);
+            }
+            if (op == TraceOp::kPushHandle) {
+                if (!anchor) {
+                    anchor = gc_malloc_root(sizeof(void*));
+                }
+                if (handles[id]++ == 0) {
+                    gc_add_edge(anchor, ptr);
+                }
+            } else if (handles[id] && --handles[id] == 0) {
+                gc_del_edge(anchor, ptr);
+            }
+            break;
+        }
+        case TraceOp::kCollect:
+            gc_collect();
+            break;
+        case TraceOp::kCollectMinor:
+            gc_collect_minor();
+            break;
+        default:
+            return finish(SIZE_MAX);
+        }
+        if (reader.Failed() || invalid) return finish(SIZE_MAX);
+        ++events;
+    }
+    return finish(events);
+}
@@ -225,9 +225,8 @@ static void BM_ReferenceIntensive(benchmark::State& state) {
             }
         }
 
-        // Генератор случайных чисел
-        std::random_device rd;
-        std::mt19937 gen(rd());
+        // Генератор случайных чисел; зерно фиксировано, чтобы прогоны были воспроизводимы
+        std::mt19937 gen(42);
         std::uniform_int_distribution<> distr(0, num_objects - 1);
 
         // Выполняем случайные операции добавления/удаления ссылок
@@ -41,8 +41,8 @@ public:
 };
 
 static void createSocialNetwork(const TestConfig& config, std::vector<User*>& users) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    // Зерно фиксировано, чтобы граф был одинаковым от прогона к прогону
+    std::mt19937 gen(42);
     std::uniform_int_distribution<> dis(0, config.users-1);
 
     users.resize(config.users);
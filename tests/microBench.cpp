@@ -0,0 +1,304 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "gc.h"
+
+// Бенчмарки отдельных частей сборщика: аллокации, маркировки, подметания и барьеров.
+// Все случайные данные берутся из генераторов с фиксированным зерном, поэтому прогоны
+// разных версий сравнимы. Результаты по умолчанию пишутся ещё и в gc_micro_bench.json
+
+namespace {
+
+constexpr uint32_t kSeed = 20240601;
+constexpr size_t kAllocBatch = 1024;
+constexpr size_t kTreeFanout = 64;
+constexpr size_t kRingSize = 16;
+constexpr size_t kRandomExtraEdges = 3;
+constexpr size_t kBarrierChildren = 1024;
+constexpr size_t kPauseListLength = 256;
+
+enum GraphShape {
+    kChain,
+    kWideTree,
+    kRandom,
+    kCycles
+};
+
+// Время маркировки и подметания берётся из телеметрии сборщика, а не замеряется вокруг gc_collect.
+// Обратный вызов включается только в однопоточных бенчмарках без фонового сборщика
+GcCycleStats last_cycle{};
+
+void RememberCycle(const GcCycleStats *cycle, void*) {
+    last_cycle = *cycle;
+}
+
+// Граф из count объектов по 32 байта; возвращает его единственный корень
+void* BuildGraph(GraphShape shape, size_t count) {
+    std::mt19937 gen(kSeed);
+    std::vector<void*> nodes(count);
+    nodes[0] = gc_malloc_root(32);
+
+    switch (shape) {
+    case kChain:
+        for (size_t i = 1; i < count; ++i) {
+            nodes[i] = gc_malloc_with_parent(32, nodes[i - 1]);
+        }
+        break;
+    case kWideTree:
+        for (size_t i = 1; i < count; ++i) {
+            nodes[i] = gc_malloc_with_parent(32, nodes[(i - 1) / kTreeFanout]);
+        }
+        break;
+    case kRandom:
+        // Остов из случайных предков держит все узлы достижимыми, остальные рёбра — куда попало
+        for (size_t i = 1; i < count; ++i) {
+            nodes[i] = gc_malloc_with_parent(32, nodes[std::uniform_int_distribution<size_t>(0, i - 1)(gen)]);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = 0; j < kRandomExtraEdges; ++j) {
+                gc_add_edge(nodes[i], nodes[std::uniform_int_distribution<size_t>(0, count - 1)(gen)]);
+            }
+        }
+        break;
+    case kCycles:
+        // Кольца по kRingSize узлов, на начало каждого ссылается корень
+        for (size_t start = 1; start < count; start += kRingSize) {
+            size_t end = std::min(start + kRingSize, count);
+            nodes[start] = gc_malloc_with_parent(32, nodes[0]);
+            for (size_t i = start + 1; i < end; ++i) {
+                nodes[i] = gc_malloc_with_parent(32, nodes[i - 1]);
+            }
+            gc_add_edge(nodes[end - 1], nodes[start]);
+        }
+        break;
+    }
+    return nodes[0];
+}
+
+// Верхняя граница корзины гистограммы, в которую попадает доля quantile пауз
+double PauseQuantileUs(const std::vector<uint64_t> &histogram, uint64_t count, double quantile) {
+    if (!count) return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        seen += histogram[i];
+        if (seen >= rank) {
+            return std::ldexp(1.0, i + 1) / 1000;
+        }
+    }
+    return 0;
+}
+
+}
+
+// Пропускная способность аллокатора: объекты сразу становятся мусором, его убирает фоновый сборщик
+static void BM_Allocate(benchmark::State& state) {
+    size_t size = state.range(0);
+    if (state.thread_index() == 0) {
+        gc_start_background_collector(100, 10);
+    }
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < kAllocBatch; ++i) {
+            benchmark::DoNotOptimize(gc_malloc(size));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * kAllocBatch);
+    state.SetBytesProcessed(state.iterations() * kAllocBatch * size);
+
+    if (state.thread_index() == 0) {
+        gc_stop_background_collector();
+        gc_collect();
+    }
+}
+
+// Маркировка живого графа заданной формы. Подметать почти нечего, но время берётся только маркировки
+static void BM_Mark(benchmark::State& state) {
+    auto shape = static_cast<GraphShape>(state.range(0));
+    size_t count = state.range(1);
+    void* root = BuildGraph(shape, count);
+    gc_set_cycle_callback(RememberCycle, nullptr);
+
+    uint64_t objects = 0;
+    uint64_t bytes = 0;
+    uint64_t edges = 0;
+    for (auto _ : state) {
+        gc_collect();
+        state.SetIterationTime(last_cycle.mark_ns / 1e9);
+        objects += last_cycle.objects_marked;
+        bytes += last_cycle.bytes_marked;
+        edges += last_cycle.edges_traced;
+    }
+    state.SetItemsProcessed(objects);
+    state.SetBytesProcessed(bytes);
+    state.counters["edges"] = benchmark::Counter(edges, benchmark::Counter::kIsRate);
+
+    gc_set_cycle_callback(nullptr, nullptr);
+    gc_delete_root(root);
+    gc_collect();
+}
+
+// Подметание count объектов по 64 байта, из которых выживает survival процентов
+static void BM_Sweep(benchmark::State& state) {
+    int survival = state.range(0);
+    size_t count = state.range(1);
+    std::mt19937 gen(kSeed);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::vector<void*> survivors;
+    gc_set_cycle_callback(RememberCycle, nullptr);
+
+    uint64_t freed = 0;
+    for (auto _ : state) {
+        void* holder = gc_malloc_root(16);
+        survivors.clear();
+        for (size_t i = 0; i < count; ++i) {
+            void* ptr = gc_malloc(64);
+            if (percent(gen) < survival) {
+                survivors.push_back(ptr);
+            }
+        }
+        gc_add_edges(holder, survivors.data(), survivors.size());
+
+        gc_collect();
+        state.SetIterationTime(last_cycle.sweep_ns / 1e9);
+        freed += last_cycle.objects_freed;
+
+        gc_delete_root(holder);
+        gc_collect();
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.SetBytesProcessed(state.iterations() * count * 64);
+    state.counters["freed"] = benchmark::Counter(freed, benchmark::Counter::kAvgIterations);
+
+    gc_set_cycle_callback(nullptr, nullptr);
+}
+
+// Цена барьеров записи. Во время маркировки барьер сверяет метки и отмечает ещё белых детей
+static void BM_EdgeBarrier(benchmark::State& state) {
+    bool marking = state.range(0);
+    bool swap = state.range(1);
+    void* parent = gc_malloc_root(16);
+    void* target = gc_malloc_with_parent(16, parent);
+    std::vector<void*> children(kBarrierChildren);
+    for (auto& child : children) {
+        child = gc_malloc_with_parent(16, parent);
+    }
+    if (swap) {
+        gc_add_edge(target, children[0]);
+    }
+    if (marking) {
+        gc_start_incremental_mark();
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        void* child = children[i % kBarrierChildren];
+        ++i;
+        if (swap) {
+            gc_swap_edge(target, child, children[i % kBarrierChildren]);
+        } else {
+            gc_add_edge(target, child);
+            gc_del_edge(target, child);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (marking) {
+        gc_finish_incremental_mark();
+    }
+    gc_delete_root(parent);
+    gc_collect();
+}
+
+// Паузы под нагрузкой: потоки строят и бросают списки, пока фоновый сборщик ведёт циклы.
+// Квантили считаются по приросту гистограммы пауз за время прогона
+static void BM_Pauses(benchmark::State& state) {
+    static GcStats before;
+    if (state.thread_index() == 0) {
+        gc_get_stats(&before);
+        gc_start_background_collector(100, 1);
+    }
+
+    std::mt19937 gen(kSeed + state.thread_index());
+    std::uniform_int_distribution<size_t> sizes(16, 256);
+    void* holder = gc_malloc_root(16);
+    void* previous = nullptr;
+    for (auto _ : state) {
+        void* list = gc_malloc_with_parent(16, holder);
+        void* tail = list;
+        for (size_t i = 0; i < kPauseListLength; ++i) {
+            tail = gc_malloc_with_parent(sizes(gen), tail);
+        }
+        if (previous) {
+            gc_del_edge(holder, previous);
+        }
+        previous = list;
+    }
+    state.SetItemsProcessed(state.iterations() * (kPauseListLength + 1));
+    gc_delete_root(holder);
+
+    if (state.thread_index() == 0) {
+        gc_stop_background_collector();
+        GcStats after;
+        gc_get_stats(&after);
+        std::vector<uint64_t> histogram(GC_PAUSE_BUCKETS);
+        uint64_t count = 0;
+        for (size_t i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+            histogram[i] = after.pause_histogram[i] - before.pause_histogram[i];
+            count += histogram[i];
+        }
+        state.counters["pauses"] = count;
+        state.counters["pause_p50_us"] = PauseQuantileUs(histogram, count, 0.5);
+        state.counters["pause_p99_us"] = PauseQuantileUs(histogram, count, 0.99);
+        state.counters["pause_max_us"] = PauseQuantileUs(histogram, count, 1.0);
+        gc_collect();
+    }
+}
+
+BENCHMARK(BM_Allocate)
+    ->Arg(16)->Arg(64)->Arg(256)->Arg(1024)->Arg(8192)->Arg(65536)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+BENCHMARK(BM_Mark)
+    ->ArgsProduct({{kChain, kWideTree, kRandom, kCycles}, {10000, 200000}})
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_Sweep)
+    ->ArgsProduct({{0, 10, 50, 90}, {200000}})
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_EdgeBarrier)
+    ->ArgsProduct({{0, 1}, {0, 1}});
+
+BENCHMARK(BM_Pauses)
+    ->ThreadRange(1, 4)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Если вывод не задан явно, результаты дублируются в JSON, чтобы сравнивать версии
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    std::string out = "--benchmark_out=gc_micro_bench.json";
+    std::string format = "--benchmark_out_format=json";
+    bool has_out = std::any_of(args.begin() + 1, args.end(), [](const char* arg) {
+        return std::strncmp(arg, "--benchmark_out=", 16) == 0;
+    });
+    if (!has_out) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    int count = args.size();
+
+    benchmark::Initialize(&count, args.data());
+    benchmark::AddCustomContext("seed", std::to_string(kSeed));
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include "gc_impl.h"
+#include <future>
 #include <iostream>
 
 void TestFinalizer(void *ptr, size_t size) {
@@ -109,4 +110,990 @@ TEST(GCCyclycTest, GarbageCollectionWithCycles) {
     gc_delete_root(node1);
     gc_collect();
     EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
-}
\ No newline at end of file
+}
+
+TEST(HeapTest, SizeClassesAndLargeObjects) {
+    for (size_t size = 1; size <= kMaxSmallSize; ++size) {
+        size_t size_class = SizeClassOf(size);
+        ASSERT_LT(size_class, kNumSizeClasses);
+        ASSERT_GE(SizeClassSize(size_class), size);
+    }
+
+    void* small = gc_malloc_root(24);
+    void* large = gc_malloc_root(1024 * 1024 + 4);
+    memset(large, 0xAB, 1024 * 1024 + 4);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(small) % 16, 0);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 2);
+
+    gc_delete_root(small);
+    gc_delete_root(large);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+
+    // Освобождённый слот переиспользуется тем же размерным классом
+    void* reused = gc_malloc(24);
+    EXPECT_EQ(reused, small);
+    gc_collect();
+}
+
+TEST(IncrementalTest, StepMarkUntilDone) {
+    void* root = gc_malloc_root(sizeof(void*));
+    void* child = gc_malloc_with_parent(sizeof(int), root);
+    gc_malloc_with_parent(sizeof(int), child);
+    gc_malloc(64);  // недостижимый объект
+
+    gc_start_incremental_mark();
+    while (gc_is_marking()) {
+        gc_step_mark();
+    }
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+
+    gc_delete_root(root);
+    gc_start_incremental_mark();
+    while (gc_is_marking()) {
+        gc_step_mark();
+    }
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(EdgeListTest, DuplicateAndHighFanoutEdges) {
+    void* parent = gc_malloc_root(sizeof(void*));
+    void* child = gc_malloc(sizeof(int));
+
+    // Ребро добавлено дважды — после одного удаления ребёнок ещё достижим
+    gc_add_edge(parent, child);
+    gc_add_edge(parent, child);
+    gc_del_edge(parent, child);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 2);
+
+    gc_del_edge(parent, child);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1);
+
+    // Больше EdgeList::kInlineEdges детей — список переезжает в кучу
+    std::vector<void*> children;
+    for (int i = 0; i < 100; ++i) {
+        children.push_back(gc_malloc(sizeof(int)));
+        gc_add_edge(parent, children.back());
+    }
+    for (int i = 0; i < 100; i += 2) {
+        gc_del_edge(parent, children[i]);
+    }
+    gc_swap_edge(parent, children[1], children[0]);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 51);
+
+    gc_delete_root(parent);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(ParallelMarkTest, MatchesSequentialMark) {
+    const size_t num_nodes = 100000;
+    std::vector<void*> nodes;
+    for (size_t i = 0; i < num_nodes; ++i) {
+        nodes.push_back(gc_malloc(sizeof(void*) * 2));
+    }
+    // Две независимые цепочки: чётные узлы достижимы из корня, нечётные — нет
+    for (size_t i = 0; i + 2 < num_nodes; ++i) {
+        gc_add_edge(nodes[i], nodes[i + 2]);
+    }
+    for (size_t i = 0; i < num_nodes; i += 1000) {
+        gc_add_edge(nodes[i], nodes[(i * 7919) % num_nodes / 2 * 2]);
+    }
+    gc_add_root(nodes[0]);
+
+    gc_set_mark_threads(4);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), num_nodes / 2);
+
+    gc_delete_root(nodes[0]);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+    gc_set_mark_threads(1);
+}
+
+TEST(MarkBitmapTest, FullCollectionDuringIncrementalCycle) {
+    void* root = gc_malloc_root(sizeof(void*));
+    void* node = root;
+    for (int i = 0; i < 1000; ++i) {
+        node = gc_malloc_with_parent(sizeof(void*), node);
+    }
+    gc_malloc(sizeof(int));  // мусор
+
+    // Полная сборка посреди инкрементального цикла дообрабатывает его серые объекты
+    GarbageCollector::GetInstance().SetStepsPerIncrement(10);
+    gc_start_incremental_mark();
+    gc_step_mark();
+    gc_collect();
+    EXPECT_FALSE(gc_is_marking());
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1001);
+
+    // Метки сброшены при подметании, следующий цикл начинается с чистых битовых карт
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1001);
+
+    gc_delete_root(root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+    GarbageCollector::GetInstance().SetStepsPerIncrement(100);
+}
+
+static int lazy_finalized = 0;
+
+TEST(LazySweepTest, SweepsOnAllocation) {
+    lazy_finalized = 0;
+    gc_set_sweep_mode(GC_SWEEP_LAZY);
+
+    void* live = gc_malloc_root(200);
+    for (int i = 0; i < 100; ++i) {
+        gc_malloc_manage(200, [](void*, size_t) { ++lazy_finalized; });
+    }
+
+    // Пауза сборки — только маркировка: мёртвые объекты ещё не тронуты, но уже не считаются
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1);
+    EXPECT_EQ(lazy_finalized, 0);
+
+    // Аллокация того же размерного класса подметает спан, а финализаторы ждут в очереди
+    gc_malloc(200);
+    EXPECT_EQ(lazy_finalized, 0);
+    EXPECT_EQ(gc_run_finalizers(SIZE_MAX), 100);
+    EXPECT_EQ(lazy_finalized, 100);
+
+    gc_delete_root(live);
+    gc_set_sweep_mode(GC_SWEEP_EAGER);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+static std::atomic<int> concurrent_finalized{0};
+
+TEST(ConcurrentSweepTest, MutatorsRunWhileSweeping) {
+    concurrent_finalized = 0;
+    gc_set_sweep_mode(GC_SWEEP_CONCURRENT);
+
+    void* root = gc_malloc_root(sizeof(void*));
+    for (int i = 0; i < 20000; ++i) {
+        gc_malloc_manage(32, [](void*, size_t) { ++concurrent_finalized; });
+    }
+    gc_collect();
+
+    // Пока поток подметает, мутатор продолжает выделять память и менять рёбра
+    for (int i = 0; i < 1000; ++i) {
+        void* child = gc_malloc(32);
+        gc_add_edge(root, child);
+        gc_del_edge(root, child);
+    }
+
+    // Переключение режима дожидается конца подметания
+    gc_set_sweep_mode(GC_SWEEP_EAGER);
+    gc_run_finalizers(SIZE_MAX);
+    EXPECT_EQ(concurrent_finalized.load(), 20000);
+
+    gc_delete_root(root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+static std::atomic<int> queued_finalized{0};
+
+TEST(FinalizerQueueTest, FinalizerThreadReclaimsAfterRunning) {
+    queued_finalized = 0;
+    gc_start_finalizer_thread();
+
+    for (int i = 0; i < 1000; ++i) {
+        gc_malloc_manage(64, [](void*, size_t) { ++queued_finalized; });
+    }
+    gc_malloc_manage(16384, [](void*, size_t) { ++queued_finalized; });
+    gc_collect();
+
+    // Слоты освобождаются только после финализатора
+    while (queued_finalized.load() < 1001) {
+        std::this_thread::yield();
+    }
+    gc_stop_finalizer_thread();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(ThreadCacheTest, ThreadsAllocateConcurrently) {
+    const int threads = 4;
+    const int objects = 10000;
+
+    // Сборка забирает слоты из кэшей работающих потоков
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&stop] {
+            while (!stop.load()) {
+                gc_malloc(24);
+            }
+        });
+    }
+    for (int i = 0; i < 20; ++i) {
+        gc_collect();
+    }
+    stop.store(true);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    std::vector<void*> roots(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&roots, t] {
+            roots[t] = gc_malloc_root(16);
+            for (int i = 0; i < objects; ++i) {
+                void* child = gc_malloc(24);
+                if (i % 10 == 0) {
+                    gc_add_edge(roots[t], child);
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), threads * (1 + objects / 10));
+
+    for (void* root : roots) {
+        gc_delete_root(root);
+    }
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(SatbBarrierTest, IncrementalCycleKeepsSnapshotAndNewObjects) {
+    GarbageCollector::GetInstance().SetStepsPerIncrement(1);
+    void* root = gc_malloc_root(sizeof(void*));
+    void* a = gc_malloc_with_parent(sizeof(void*), root);
+    void* b = gc_malloc_with_parent(sizeof(void*), a);
+
+    gc_start_incremental_mark();
+    // Объекты, созданные во время маркировки, выделяются отмеченными
+    void* fresh = gc_malloc(16);
+    gc_malloc_with_parent(16, fresh);
+    // Ребро снято до того, как маркировка дошла до a: барьер удаления сохраняет b в этом цикле
+    gc_del_edge(a, b);
+    gc_add_edge(fresh, b);
+    while (gc_is_marking()) {
+        gc_step_mark();
+    }
+    gc_add_root(fresh);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 5);
+
+    // Удалённый во время маркировки корень доживает до конца цикла и собирается в следующем
+    gc_start_incremental_mark();
+    gc_delete_root(root);
+    gc_finish_incremental_mark();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 5);
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+
+    gc_delete_root(fresh);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+    GarbageCollector::GetInstance().SetStepsPerIncrement(100);
+}
+
+TEST(BudgetedStepTest, TimeAndWorkBudgets) {
+    void* root = gc_malloc_root(sizeof(void*));
+    const int fanout = 10000;
+    for (int i = 0; i < fanout; ++i) {
+        gc_malloc_with_parent(16, root);
+    }
+
+    // Шаг без бюджета обрабатывает один объект — корень со всеми его рёбрами
+    gc_start_incremental_mark();
+    EXPECT_FALSE(gc_step_mark_for(0));
+    while (!gc_step_mark_for(200000)) {
+    }
+    EXPECT_FALSE(gc_is_marking());
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), fanout + 1);
+
+    // Корень стоит fanout + 1 единиц работы, каждый лист — одну
+    for (int i = 0; i < fanout; ++i) {
+        gc_malloc(16);  // мусор
+    }
+    gc_start_incremental_mark();
+    GcStats before;
+    gc_get_stats(&before);
+    EXPECT_FALSE(gc_step_mark_work(1));
+    EXPECT_FALSE(gc_step_mark_work(fanout / 2));
+    EXPECT_TRUE(gc_step_mark_work(fanout));
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), fanout + 1);
+    // Шаг с бюджетом, завершивший цикл, не подметает кучу и в режиме EAGER
+    GcStats after;
+    gc_get_stats(&after);
+    EXPECT_EQ(after.objects_freed, before.objects_freed);
+
+    gc_delete_root(root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(PacerTest, BackgroundCollectorKeepsHeapBounded) {
+    gc_set_gc_percent(100);
+    // Интервал больше времени теста: циклы запускает только пейсер, а доводят их помощники-мутаторы
+    gc_start_background_collector(100, 60000);
+
+    const size_t objects = 1 << 21;
+    for (size_t i = 0; i < objects; ++i) {
+        gc_malloc(32);
+    }
+    EXPECT_LT(GarbageCollector::GetInstance().GetAllocationsCount(), objects / 2);
+    gc_stop_background_collector();
+
+    // Без пейсера фоновый сборщик ведёт полные циклы по интервалу
+    gc_set_gc_percent(-1);
+    GcStats before;
+    gc_get_stats(&before);
+    gc_start_background_collector(100, 5);
+    GcStats after = before;
+    for (int i = 0; i < 400 && after.full_cycles < before.full_cycles + 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        gc_get_stats(&after);
+    }
+    EXPECT_GE(after.full_cycles, before.full_cycles + 2);
+    gc_stop_background_collector();
+    gc_set_gc_percent(100);
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(GenerationalTest, MinorCollectionTracesOnlyNursery) {
+    // Полная сборка повышает корень в старое поколение
+    void* old_root = gc_malloc_root(sizeof(void*));
+    gc_collect();
+
+    // Молодой мусор и молодой ребёнок старого объекта: ссылку запоминает барьер
+    for (int i = 0; i < 1000; ++i) {
+        gc_malloc(32);
+    }
+    void* child = gc_malloc_with_parent(32, old_root);
+    void* young_root = gc_malloc_root(16);
+    gc_collect_minor();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+
+    // Вторая малая сборка повышает выживших; молодой внук повышенного ребёнка
+    // держится через запомненное множество, пересобранное после повышения
+    gc_collect_minor();
+    void* grandchild = gc_malloc(16);
+    gc_add_edge(child, grandchild);
+    gc_collect_minor();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 4);
+
+    // Старый объект без рёбер к молодым не мешает собрать молодой мусор
+    gc_del_edge(child, grandchild);
+    gc_collect_minor();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+
+    // К этому моменту повышены оба корня. Старые объекты малая сборка не трогает, даже недостижимые
+    gc_delete_root(old_root);
+    gc_delete_root(young_root);
+    gc_collect_minor();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(GenerationalTest, OldToYoungEdgeAddedDuringMinorMark) {
+    void* old_root = gc_malloc_root(16);
+    gc_collect();
+
+    // Ребёнок выделен до малой сборки и до подвешивания к старому объекту известен только этому потоку
+    auto* child = static_cast<uint64_t*>(gc_malloc(64));
+    std::fill(child, child + 8, uint64_t{42});
+
+    // Сборщик ждёт между паузами, пока ребро не появится после снимка запомненного множества
+    std::promise<void> marking;
+    std::promise<void> linked;
+    GarbageCollector::GetInstance().SetMinorMarkHook([&marking, &linked] {
+        marking.set_value();
+        linked.get_future().wait();
+    });
+    std::thread collector([] {
+        gc_collect_minor();
+    });
+    marking.get_future().wait();
+    gc_add_edge(old_root, child);
+    linked.set_value();
+    collector.join();
+    GarbageCollector::GetInstance().SetMinorMarkHook(nullptr);
+    EXPECT_EQ(std::count(child, child + 8, uint64_t{42}), 8);
+
+    gc_delete_root(old_root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(GenerationalTest, PromotedObjectInUnsweptSpan) {
+    gc_set_sweep_mode(GC_SWEEP_LAZY);
+    void* old_root = gc_malloc_root(16);
+    gc_collect();
+
+    // Спан корня ещё не подметён и хранит молодой бит, но корень уже повышен: ребро запоминается
+    void* child = gc_malloc(64);
+    std::fill(static_cast<char*>(child), static_cast<char*>(child) + 64, 'x');
+    gc_add_edge(old_root, child);
+    gc_collect_minor();
+    EXPECT_EQ(std::count(static_cast<char*>(child), static_cast<char*>(child) + 64, 'x'), 64);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 2);
+
+    gc_delete_root(old_root);
+    gc_set_sweep_mode(GC_SWEEP_EAGER);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(ConcurrentCollectTest, MutatorsRunWhileCollectorThreadMarks) {
+    void* root = gc_malloc_root(sizeof(void*));
+    const int chains = 100;
+    const int length = 1000;
+    for (int i = 0; i < chains; ++i) {
+        void* last = root;
+        for (int j = 0; j < length; ++j) {
+            last = gc_malloc_with_parent(16, last);
+        }
+    }
+
+    // Мутатор всё время перевешивает kept через временный объект: пока идёт маркировка,
+    // его держат барьеры, а временные объекты становятся мусором
+    std::atomic<bool> stop{false};
+    void* own = gc_malloc_root(16);
+    void* kept = gc_malloc_with_parent(16, own);
+    std::thread mutator([&] {
+        while (!stop.load()) {
+            void* tmp = gc_malloc_with_parent(16, own);
+            gc_add_edge(tmp, kept);
+            gc_del_edge(own, kept);
+            gc_add_edge(own, kept);
+            gc_del_edge(tmp, kept);
+            gc_del_edge(own, tmp);
+        }
+    });
+
+    gc_collect_concurrent();
+    gc_wait_for_collection();
+    stop.store(true);
+    mutator.join();
+
+    GcPauseInfo pauses;
+    gc_get_last_pauses(&pauses);
+    EXPECT_GT(pauses.initial_pause_ns, 0);
+    EXPECT_GT(pauses.final_pause_ns, 0);
+    EXPECT_GT(pauses.concurrent_mark_ns, 0);
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), chains * length + 3);
+
+    gc_delete_root(own);
+    gc_delete_root(root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(BatchApiTest, EdgesAndRootsInBulk) {
+    const size_t count = 1000;
+    std::vector<void*> roots(4);
+    for (auto &root : roots) {
+        root = gc_malloc(sizeof(void*));
+    }
+    gc_add_roots(roots.data(), roots.size());
+
+    // Повторы в пачке считаются как отдельные добавления ребра
+    std::vector<void*> children(count);
+    for (auto &child : children) {
+        child = gc_malloc(16);
+    }
+    gc_add_edge(roots[0], children[0]);
+    std::vector<void*> batch(children);
+    batch.push_back(children[1]);
+    gc_add_edges(roots[0], batch.data(), batch.size());
+    gc_del_edge(roots[0], children[0]);
+    gc_del_edge(roots[0], children[1]);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), roots.size() + count);
+
+    // Пары раскладываются по родителям; без корней остаются только дети roots[3]
+    std::vector<GcEdge> pairs;
+    for (size_t i = 0; i < count; ++i) {
+        void* grandchild = gc_malloc(16);
+        pairs.push_back({children[i], grandchild});
+        pairs.push_back({roots[1 + i % 3], grandchild});
+    }
+    gc_add_edges_pairs(pairs.data(), pairs.size());
+    gc_delete_roots(roots.data(), 3);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1 + count / 3);
+
+    gc_delete_roots(roots.data() + 3, 1);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+struct TypedNode {
+    TypedNode* left;
+    int value;
+    TypedNode* right;
+};
+
+TEST(TypedLayoutTest, MarkerReadsPointerFields) {
+    auto make = [] { return gc::New<TypedNode, &TypedNode::left, &TypedNode::right>(); };
+
+    TypedNode* root = make();
+    gc_add_root(root);
+    TypedNode* middle = nullptr;
+    TypedNode* last = root;
+    for (int i = 0; i < 100; ++i) {
+        TypedNode* node = make();
+        EXPECT_EQ(node->left, nullptr);
+        gc::Store(last, i % 2 ? &TypedNode::left : &TypedNode::right, node);
+        last = node;
+        if (i == 49) {
+            middle = node;
+        }
+    }
+    for (int i = 0; i < 10; ++i) {
+        make();
+    }
+    // Рёбра у типизированного объекта тоже работают
+    gc_add_edge(last, gc_malloc(16));
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 102);
+
+    gc::Store(middle, &TypedNode::left, nullptr);
+    gc::Store(middle, &TypedNode::right, nullptr);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 51);
+
+    size_t misaligned = 4;
+    EXPECT_EQ(gc_register_type(16, &misaligned, 1), 0);
+    EXPECT_EQ(gc_malloc_typed(0), nullptr);
+
+    gc_delete_root(root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(StackScanTest, RegisteredStacksKeepObjects) {
+    std::atomic<int> phase{0};
+    std::thread worker([&phase] {
+        ASSERT_TRUE(gc_register_thread());
+        // Указатель на начало объекта и указатель внутрь другого — оба держат объекты живыми
+        void* volatile object = gc_malloc(32);
+        gc_malloc_with_parent(16, object);
+        char* volatile inner = static_cast<char*>(gc_malloc(64)) + 40;
+        phase.store(1);
+        while (phase.load() == 1) {
+            std::this_thread::yield();
+        }
+        (void)inner;
+        gc_unregister_thread();
+    });
+
+    while (phase.load() == 0) {
+        std::this_thread::yield();
+    }
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 3);
+    phase.store(2);
+    worker.join();
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+
+    // Стек потока, который сам запускает сборку, просматривается без сигнала
+    ASSERT_TRUE(gc_register_thread());
+    void* volatile kept = gc_malloc(16);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1);
+    (void)kept;
+    gc_unregister_thread();
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(InteriorPointerTest, FieldsAndElementsResolveToObject) {
+    struct Pair {
+        long key;
+        long value;
+    };
+    auto* array = static_cast<Pair*>(gc_malloc_root(16 * sizeof(Pair)));
+    auto* big = static_cast<char*>(gc_malloc(1 << 20));
+
+    // Рёбра от элементов массива к середине объектов, корень — через поле
+    void* child = gc_malloc(64);
+    gc_add_edge(&array[3].value, static_cast<char*>(child) + 32);
+    gc_add_edge(&array[7], big + 12345);
+    auto* field_root = static_cast<Pair*>(gc_malloc(sizeof(Pair)));
+    gc_add_root(&field_root->value);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 4);
+
+    // Снять ребро и корень можно другим адресом внутри тех же объектов
+    gc_del_edge(&array[0], child);
+    gc_del_edge(array, big + (1 << 19));
+    gc_delete_root(field_root);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 1);
+
+    gc_delete_root(&array[15].key);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(CompactionTest, EvacuatesSparseSpansAndUpdatesReferences) {
+    struct Item {
+        Item* next;
+        long value;
+    };
+    auto make = [] { return gc::New<Item, &Item::next>(); };
+
+    // Живой список вперемешку с мусором того же размера: после сборки спаны полупустые
+    const long items = 4000;
+    Item* head = make();
+    gc_add_root(head);
+    Item* last = head;
+    Item* pinned = nullptr;
+    for (long i = 0; i < items; ++i) {
+        Item* item = make();
+        item->value = i;
+        gc::Store(last, &Item::next, item);
+        last = item;
+        if (i == items / 2) {
+            pinned = item;
+            gc_pin(pinned);
+        }
+        for (int j = 0; j < 7; ++j) {
+            make();
+        }
+    }
+    // Нетипизированный ребёнок хранит адрес внука в своих данных: оба остаются на месте,
+    // хотя их спан почти пуст
+    void* grandchild = gc_malloc(16);
+    *static_cast<long*>(grandchild) = 42;
+    auto* child = static_cast<void**>(gc_malloc_with_parent(16, head));
+    *child = grandchild;
+    gc_add_edge(child, grandchild);
+    for (int j = 0; j < 1000; ++j) {
+        gc_malloc(16);
+    }
+    std::vector<Item*> before;
+    for (Item* item = head->next; item; item = item->next) {
+        before.push_back(item);
+    }
+
+    EXPECT_GT(gc_compact(), 0);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), items + 3);
+    ASSERT_EQ(*child, grandchild);
+    EXPECT_EQ(*static_cast<long*>(grandchild), 42);
+
+    size_t moved = 0;
+    bool pinned_seen = false;
+    long expected = 0;
+    for (Item* item = head->next; item; item = item->next) {
+        EXPECT_EQ(item->value, expected);
+        moved += item != before[expected++];
+        pinned_seen |= item == pinned;
+    }
+    EXPECT_EQ(expected, items);
+    EXPECT_TRUE(pinned_seen);
+    EXPECT_GT(moved, items / 2);
+
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), items + 3);
+    gc_unpin(pinned);
+    gc_delete_root(head);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(ScavengerTest, ReleasesIdlePages) {
+    const int objects = 20000;
+    for (int i = 0; i < objects; ++i) {
+        gc_malloc(64);
+    }
+    gc_collect();
+    EXPECT_GT(gc_release_memory(), 0);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetIdleBytes(), 0);
+    EXPECT_EQ(gc_release_memory(), 0);
+
+    for (int i = 0; i < objects; ++i) {
+        gc_malloc(64);
+    }
+    gc_collect();
+    EXPECT_GT(GarbageCollector::GetInstance().GetIdleBytes(), 0);
+
+    gc_set_scavenge_delay(0);
+    gc_start_background_collector(100, 5);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (GarbageCollector::GetInstance().GetIdleBytes() > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    gc_stop_background_collector();
+    gc_set_scavenge_delay(1000);
+
+    EXPECT_EQ(GarbageCollector::GetInstance().GetIdleBytes(), 0);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(StatsTest, CyclesReportWorkAndPauses) {
+    std::vector<GcCycleStats> cycles;
+    gc_set_cycle_callback([](const GcCycleStats *cycle, void *arg) {
+        static_cast<std::vector<GcCycleStats>*>(arg)->push_back(*cycle);
+    }, &cycles);
+    GcStats before;
+    gc_get_stats(&before);
+
+    const int live = 1000;
+    const int garbage = 3000;
+    void* head = gc_malloc_root(32);
+    void* tail = head;
+    for (int i = 1; i < live; ++i) {
+        tail = gc_malloc_with_parent(32, tail);
+    }
+    for (int i = 0; i < garbage; ++i) {
+        gc_malloc(48);
+    }
+    for (int i = 0; i < 10; ++i) {
+        gc_malloc_manage(16, [](void*, size_t) {});
+    }
+    gc_collect();
+
+    ASSERT_EQ(cycles.size(), 1);
+    EXPECT_FALSE(cycles[0].minor);
+    EXPECT_GE(cycles[0].objects_marked, live);
+    EXPECT_GE(cycles[0].bytes_marked, live * 32);
+    EXPECT_GE(cycles[0].edges_traced, live - 1);
+    EXPECT_GE(cycles[0].objects_freed, garbage);
+    EXPECT_GE(cycles[0].bytes_freed, garbage * 48);
+    EXPECT_GE(cycles[0].mark_ns, cycles[0].initial_pause_ns + cycles[0].final_pause_ns);
+
+    // Снятая во время маркировки ссылка отмечается барьером
+    void* child = gc_malloc_with_parent(16, head);
+    gc_start_incremental_mark();
+    gc_del_edge(head, child);
+    gc_finish_incremental_mark();
+    ASSERT_EQ(cycles.size(), 2);
+    EXPECT_GE(cycles[1].barrier_hits, 1);
+    EXPECT_GE(cycles[1].objects_finalized, 10);
+
+    gc_collect_minor();
+    ASSERT_EQ(cycles.size(), 3);
+    EXPECT_TRUE(cycles[2].minor);
+    EXPECT_EQ(cycles[2].cycle, cycles[0].cycle + 2);
+
+    GcStats after;
+    gc_get_stats(&after);
+    EXPECT_EQ(after.full_cycles, before.full_cycles + 2);
+    EXPECT_EQ(after.minor_cycles, before.minor_cycles + 1);
+    EXPECT_GE(after.pause_count, before.pause_count + 6);
+    EXPECT_GE(after.objects_finalized, before.objects_finalized + 10);
+    EXPECT_GE(after.allocated_bytes, before.allocated_bytes + garbage * 48);
+    EXPECT_GE(after.live_bytes, live * 32);
+    EXPECT_GT(after.pause_max_ns, 0);
+    EXPECT_LE(after.pause_p50_ns, after.pause_p99_ns);
+    EXPECT_LE(after.pause_p99_ns, after.pause_max_ns);
+
+    gc_set_cycle_callback(nullptr, nullptr);
+    gc_delete_root(head);
+    gc_collect();
+    EXPECT_EQ(cycles.size(), 3);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(TraceTest, RecordsAndReplaysWorkload) {
+    std::string path = ::testing::TempDir() + "gc_trace_test.bin";
+    std::vector<uint64_t> marked;
+    gc_set_cycle_callback([](const GcCycleStats *cycle, void *arg) {
+        static_cast<std::vector<uint64_t>*>(arg)->push_back(cycle->objects_marked);
+    }, &marked);
+
+    // Корень, созданный до записи, попадает в начало трассы
+    void* before = gc_malloc_root(16);
+    ASSERT_TRUE(gc_trace_start(path.c_str()));
+    EXPECT_FALSE(gc_trace_start(path.c_str()));
+
+    void* root = gc_malloc_root(32);
+    std::vector<void*> children(20);
+    for (auto& child : children) {
+        child = gc_malloc_with_parent(24, root);
+    }
+    gc_add_edges(children[0], children.data() + 1, children.size() - 1);
+    gc_del_edge(root, children[5]);
+    gc_swap_edge(root, children[6], before);
+    TypedNode* node = gc::New<TypedNode, &TypedNode::left, &TypedNode::right>();
+    gc_add_edge(root, node);
+    gc::Store(node, &TypedNode::right, static_cast<TypedNode*>(gc_malloc(sizeof(TypedNode))));
+    gc::Store(node, &TypedNode::left, static_cast<TypedNode*>(gc_malloc_with_parent(sizeof(TypedNode), before)));
+    gc_malloc_manage(64, TestFinalizer);
+    gc_collect();
+    gc_delete_root(root);
+    gc_delete_root(before);
+    gc_collect();
+    size_t events = gc_trace_stop();
+    EXPECT_GT(events, 0);
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+
+    EXPECT_EQ(ReplayTrace(path), events);
+    ASSERT_EQ(marked.size(), 4);
+    EXPECT_GT(marked[0], children.size());
+    EXPECT_EQ(marked[2], marked[0]);
+    EXPECT_EQ(marked[3], marked[1]);
+    EXPECT_EQ(ReplayTrace(path + ".missing"), SIZE_MAX);
+
+    gc_set_cycle_callback(nullptr, nullptr);
+    std::remove(path.c_str());
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(TraceTest, ReplaysTraceStartedOnLiveHeap) {
+    std::string path = ::testing::TempDir() + "gc_trace_live_test.bin";
+    // Граф, построенный до записи, попадает в трассу снимком вместе с полями и хэндлом
+    void* root = gc_malloc_root(16);
+    void* child = gc_malloc_with_parent(4096, root);
+    TypedNode* node = gc::New<TypedNode, &TypedNode::left, &TypedNode::right>();
+    gc::Store(node, &TypedNode::left, static_cast<TypedNode*>(gc_malloc(sizeof(TypedNode))));
+    {
+        gc::Root<TypedNode> handle(node);
+        ASSERT_TRUE(gc_trace_start(path.c_str()));
+        gc_add_edge(child, gc_malloc(16));
+        gc_collect();
+        gc_add_edge(child, gc_malloc(16));
+        gc_add_edge(node->left, gc_malloc(16));
+    }
+    gc_collect();
+    gc_delete_root(root);
+    gc_collect();
+    size_t events = gc_trace_stop();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+
+    EXPECT_EQ(ReplayTrace(path), events);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+
+    // Ребро к объекту, освобождённому сборкой, отвергается, а не передаётся сборщику
+    {
+        TraceWriter writer;
+        ASSERT_TRUE(writer.Open(path));
+        writer.Write(kTraceMagic, sizeof(kTraceMagic));
+        const uint8_t freed[] = {
+            static_cast<uint8_t>(TraceOp::kMalloc), 16,
+            static_cast<uint8_t>(TraceOp::kCollect),
+            static_cast<uint8_t>(TraceOp::kAddEdge), 0, 0,
+        };
+        writer.Write(freed, sizeof(freed));
+    }
+    EXPECT_EQ(ReplayTrace(path), SIZE_MAX);
+    std::remove(path.c_str());
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(HeapSnapshotTest, DominatorsAndRetainedSizes) {
+    std::string path = ::testing::TempDir() + "gc_heap_test.bin";
+    void* a = gc_malloc_root(32);
+    void* b = gc_malloc_with_parent(64, a);
+    void* d = gc_malloc_with_parent(16, a);
+    void* c = gc_malloc_with_parent(16, b);
+    gc_add_edge(d, c);
+    auto* node = gc::New<TypedNode, &TypedNode::left, &TypedNode::right>();
+    gc_add_edge(b, node);
+    void* leaf = gc_malloc(sizeof(TypedNode));
+    gc::Store(node, &TypedNode::left, static_cast<TypedNode*>(leaf));
+    // Мусор до сборки остаётся в снимке, но недостижим
+    void* garbage = gc_malloc(48);
+    gc_add_edge(garbage, c);
+    ASSERT_TRUE(gc_dump_heap(path.c_str()));
+
+    HeapSnapshot snapshot;
+    ASSERT_TRUE(ReadSnapshot(path, snapshot));
+    std::remove(path.c_str());
+    ASSERT_EQ(snapshot.ObjectCount(), 7);
+    ASSERT_EQ(snapshot.roots_.size(), 1);
+    auto index = [&snapshot](void* ptr) {
+        return snapshot.Find(reinterpret_cast<uint64_t>(ptr));
+    };
+    EXPECT_EQ(snapshot.roots_[0], index(a));
+
+    DominatorTree tree = ComputeDominators(snapshot);
+    EXPECT_EQ(tree.reachable_, 6);
+    EXPECT_EQ(tree.idom_[index(a)], snapshot.ObjectCount());
+    EXPECT_EQ(tree.idom_[index(b)], index(a));
+    EXPECT_EQ(tree.idom_[index(c)], index(a));
+    EXPECT_EQ(tree.idom_[index(leaf)], index(node));
+    EXPECT_EQ(tree.idom_[index(garbage)], DominatorTree::kUnreachable);
+    EXPECT_EQ(tree.retained_[index(b)], 64 + 2 * sizeof(TypedNode));
+    EXPECT_EQ(tree.retained_[index(a)], 32 + 64 + 16 + 16 + 2 * sizeof(TypedNode));
+    EXPECT_EQ(tree.retained_[snapshot.ObjectCount()], tree.retained_[index(a)]);
+
+    gc_delete_root(a);
+    gc_collect();
+    EXPECT_EQ(GarbageCollector::GetInstance().GetAllocationsCount(), 0);
+}
+
+TEST(HandleTest, ScopedRootsKeepObjects) {
+    auto count = [] {
+        return GarbageCollector::GetInstance().GetAllocationsCount();
+    };
+    {
+        gc::Root<TypedNode> outer(gc::New<TypedNode, &TypedNode::left, &TypedNode::right>());
+        gc::Store(outer.get(), &TypedNode::left, static_cast<TypedNode*>(gc_malloc(sizeof(TypedNode))));
+
+        // Глубже одного куска стека хэндлов
+        const int depth = 600;
+        std::function<void(int)> nest = [&](int left) {
+            if (left == 0) {
+                gc_collect();
+                EXPECT_EQ(count(), depth + 2);
+                return;
+            }
+            gc::Root<void> handle(gc_malloc(16));
+            nest(left - 1);
+        };
+        nest(depth);
+        gc_collect();
+        EXPECT_EQ(count(), 2);
+
+        // Хэндл на объект, выделенный до начала маркировки, появляется посреди цикла
+        void* early = gc_malloc(16);
+        gc_start_incremental_mark();
+        {
+            gc::Root<void> late(early);
+            gc_finish_incremental_mark();
+            EXPECT_EQ(count(), 3);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::atomic<int> corrupted{0};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&corrupted, t] {
+            for (int i = 0; i < 200; ++i) {
+                gc::Root<unsigned char> held(static_cast<unsigned char*>(gc_malloc(64)));
+                memset(held.get(), t + 1, 64);
+                for (int j = 0; j < 100; ++j) {
+                    gc_malloc(64);
+                }
+                if (i % 50 == 0) {
+                    gc_collect();
+                }
+                for (int k = 0; k < 64; ++k) {
+                    corrupted += held.get()[k] != t + 1;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(corrupted, 0);
+
+    gc_collect();
+    EXPECT_EQ(count(), 0);
+}
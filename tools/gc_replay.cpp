@@ -0,0 +1,38 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "gc.h"
+#include "gc_trace.h"
+
+// Воспроизводит трассу, записанную через gc_trace_start, и печатает время и телеметрию сборщика.
+// Повторы идут подряд в одной куче, объекты прошлых прогонов остаются, если трасса не сняла их корни
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <trace> [repeat]\n", argv[0]);
+        return 2;
+    }
+    int repeat = argc > 2 ? std::atoi(argv[2]) : 1;
+
+    for (int run = 0; run < repeat; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        size_t events = ReplayTrace(argv[1]);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (events == SIZE_MAX) {
+            std::fprintf(stderr, "%s: not a trace, truncated or refers to a freed object\n", argv[1]);
+            return 1;
+        }
+        std::printf("run %d: %zu events in %.3f s, %.0f events/s\n", run, events, seconds, events / seconds);
+    }
+
+    GcStats stats;
+    gc_get_stats(&stats);
+    std::printf("cycles: %llu full, %llu minor\n",
+                static_cast<unsigned long long>(stats.full_cycles), static_cast<unsigned long long>(stats.minor_cycles));
+    std::printf("mark: %.3f ms, sweep: %.3f ms, marked %llu objects\n", stats.mark_ns / 1e6, stats.sweep_ns / 1e6,
+                static_cast<unsigned long long>(stats.objects_marked));
+    std::printf("pauses: %llu, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                static_cast<unsigned long long>(stats.pause_count), stats.pause_p50_ns / 1e3,
+                stats.pause_p99_ns / 1e3, stats.pause_max_ns / 1e3);
+    return 0;
+}